@@ -0,0 +1,387 @@
+// Benchmarks parsing and formatting on synthetic songs.
+// Prints one JSON object with timings, throughput,
+// allocation counts and peak memory per phase.
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <fstream>
+#include <iterator>
+#include <memory>
+#include <new>
+#include <ostream>
+#include <random>
+#include <streambuf>
+#include <string>
+#include <vector>
+
+#include <fcntl.h>
+#include <sys/resource.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+#include <fmt/core.h>
+
+#define JARGS_IMPLEMENTATION
+#include "jargs.hpp"
+
+#include "file.hpp"
+#include "trace.hpp"
+
+// GCC sees malloc() and free() pair up with new and delete
+// once the replacements below are inlined
+#pragma GCC diagnostic ignored "-Wmismatched-new-delete"
+
+static std::atomic<size_t> alloc_count = 0;
+static std::atomic<size_t> alloc_bytes = 0;
+
+void *operator new(size_t n)
+{
+    alloc_count.fetch_add(1, std::memory_order_relaxed);
+    alloc_bytes.fetch_add(n, std::memory_order_relaxed);
+    if (void *p = std::malloc(n ? n : 1))
+        return p;
+    throw std::bad_alloc();
+}
+
+void operator delete(void *p) noexcept { std::free(p); }
+void operator delete(void *p, size_t) noexcept { std::free(p); }
+
+// Used by std::pmr resources
+void *operator new(size_t n, std::align_val_t al)
+{
+    alloc_count.fetch_add(1, std::memory_order_relaxed);
+    alloc_bytes.fetch_add(n, std::memory_order_relaxed);
+    size_t align = std::max((size_t)al, sizeof(void*));
+    if (void *p = std::aligned_alloc(align, (std::max<size_t>(n, 1) + align - 1) / align * align))
+        return p;
+    throw std::bad_alloc();
+}
+
+void operator delete(void *p, std::align_val_t) noexcept { std::free(p); }
+void operator delete(void *p, size_t, std::align_val_t) noexcept { std::free(p); }
+
+struct GeneratorConfig {
+    int sections = 200;
+    int lines = 8; // Per section
+    int line_length = 60; // Characters
+    double chord_density = 0.25; // Share of words with a chord
+    int reproductions = 50; // [<Chorus] sections
+    double utf8_share = 0.1; // Share of non-ASCII words
+    unsigned seed = 1;
+};
+
+static std::string generate_song(const GeneratorConfig &cfg)
+{
+    static const char *ascii_words[] = { "glory", "the", "of", "lord", "coming", "truth", "marching", "on", "hallelujah", "his" };
+    static const char *utf8_words[] = { "über", "Жизнь", "café", "мир", "日本", "señor", "ποτέ", "naïve" };
+    static const char *chord_names[] = { "G", "D7", "Em", "C", "Am7", "G7/B", "F#m", "Bb", "Dsus4" };
+
+    std::mt19937 rng(cfg.seed);
+    std::uniform_real_distribution<double> p(0, 1);
+    auto pick = [&rng](const auto &arr) {
+        return arr[std::uniform_int_distribution<size_t>(0, std::size(arr) - 1)(rng)];
+    };
+
+    std::string out = "title: Synthetic\nauthor: Generator\nkey: G\ncapo: None\n\n";
+
+    auto section_body = [&]() {
+        std::string chords = "chords:";
+        std::string text;
+        for (int l = 0; l < cfg.lines; l++) {
+            size_t line_beg = text.size();
+            while (text.size() - line_beg < (size_t)cfg.line_length) {
+                if (p(rng) < cfg.chord_density) {
+                    text += '>';
+                    chords += ' ';
+                    chords += pick(chord_names);
+                }
+                text += p(rng) < cfg.utf8_share ? pick(utf8_words) : pick(ascii_words);
+                text += ' ';
+            }
+            text += '\n';
+        }
+        return chords + "\n" + text + "\n";
+    };
+
+    int reproductions_left = cfg.reproductions;
+    for (int s = 0; s < cfg.sections; s++) {
+        if (s == 0 && cfg.reproductions > 0) {
+            out += "[>Chorus]\n" + section_body();
+        } else if (reproductions_left > 0 && s % std::max(1, cfg.sections / cfg.reproductions) == 0) {
+            out += "[<Chorus]\n\n";
+            reproductions_left--;
+        } else {
+            out += fmt::format("[Verse {}]\n", s) + section_body();
+        }
+    }
+
+    return out;
+}
+
+// Discards output, but counts it
+class CountingBuf : public std::streambuf {
+public:
+    size_t bytes = 0;
+protected:
+    int_type overflow(int_type c) override { bytes++; return c; }
+    std::streamsize xsputn(const char *, std::streamsize n) override { bytes += n; return n; }
+};
+
+struct Result {
+    std::string phase;
+    size_t bytes = 0; // Processed per iteration
+    std::vector<double> ns = {};
+    size_t allocs = 0;
+    size_t alloc_bytes = 0;
+    size_t output_bytes = 0; // Of the PDF
+    long peak_rss_kb = 0;
+    std::string compress = {}; // Of the PDF, as in the song header
+};
+
+// Peak resident memory of a child process running fn(), in KiB. The
+// child starts out with what it shares with the bench, so only the
+// differences between phases mean anything.
+template<typename F>
+static long child_peak_rss(F &&fn)
+{
+    fflush(stdout);
+    pid_t pid = fork();
+    if (pid == 0) {
+        fn();
+        _exit(0);
+    }
+
+    int status;
+    struct rusage ru;
+    if (pid < 0 || wait4(pid, &status, 0, &ru) < 0)
+        return 0;
+    return ru.ru_maxrss;
+}
+
+static void print_json(const GeneratorConfig &cfg, int iterations, int jobs, const std::string &input,
+                       size_t input_bytes, const std::vector<Result> &results)
+{
+    fmt::print("{{\n");
+    if (input.empty()) {
+        fmt::print("  \"config\": {{\"sections\": {}, \"lines\": {}, \"line_length\": {}, \"chord_density\": {}, "
+                   "\"reproductions\": {}, \"utf8_share\": {}, \"seed\": {}, ",
+                   cfg.sections, cfg.lines, cfg.line_length, cfg.chord_density,
+                   cfg.reproductions, cfg.utf8_share, cfg.seed);
+    } else {
+        fmt::print("  \"config\": {{\"input\": \"{}\", ", trace::json_escape(input));
+    }
+    fmt::print("\"iterations\": {}, \"jobs\": {}}},\n", iterations, jobs);
+    fmt::print("  \"input_bytes\": {},\n", input_bytes);
+    fmt::print("  \"results\": [\n");
+    for (size_t i = 0; i < results.size(); i++) {
+        const Result &r = results[i];
+        std::vector<double> sorted = r.ns;
+        std::sort(sorted.begin(), sorted.end());
+
+        double mean = 0;
+        for (double ns : sorted)
+            mean += ns;
+        mean /= sorted.size();
+
+        fmt::print("    {{\"phase\": \"{}\"{}, \"mean_ns\": {:.0f}, \"min_ns\": {:.0f}, \"median_ns\": {:.0f}, "
+                   "\"throughput_mb_s\": {:.2f}, \"allocs_per_iter\": {}, \"alloc_bytes_per_iter\": {}{}{}}}{}\n",
+                   r.phase, r.compress.empty() ? "" : fmt::format(", \"compress\": \"{}\"", r.compress),
+                   mean, sorted.front(), sorted[sorted.size() / 2],
+                   r.bytes / (mean / 1e9) / 1e6,
+                   r.allocs / sorted.size(), r.alloc_bytes / sorted.size(),
+                   r.output_bytes ? fmt::format(", \"output_bytes\": {}", r.output_bytes) : "",
+                   r.peak_rss_kb ? fmt::format(", \"peak_rss_kb\": {}", r.peak_rss_kb) : "",
+                   i + 1 < results.size() ? "," : "");
+    }
+    fmt::print("  ]\n}}\n");
+}
+
+int main(int argc, char **argv)
+{
+    GeneratorConfig cfg;
+    int iterations = 20;
+    int jobs = 1;
+    bool pdf = true;
+    std::string input;
+    Options options;
+
+    auto int_flag = [](int &dst) {
+        return [&dst](std::string_view optarg) { dst = std::stoi(std::string(optarg)); };
+    };
+    auto double_flag = [](double &dst) {
+        return [&dst](std::string_view optarg) { dst = std::stod(std::string(optarg)); };
+    };
+
+    jargs::Parser parser;
+    parser.add({"sections", "Number of sections", int_flag(cfg.sections)});
+    parser.add({"lines", "Lines per section", int_flag(cfg.lines)});
+    parser.add({"line-length", "Characters per line", int_flag(cfg.line_length)});
+    parser.add({"chord-density", "Share of words with a chord (0-1)", double_flag(cfg.chord_density)});
+    parser.add({"reproductions", "Number of [<Chorus] sections", int_flag(cfg.reproductions)});
+    parser.add({"utf8-share", "Share of non-ASCII words (0-1)", double_flag(cfg.utf8_share)});
+    parser.add({"seed", "Random seed", [&cfg](auto optarg) { cfg.seed = std::stoul(std::string(optarg)); }});
+    parser.add({'n', "iterations", "Iterations per phase", int_flag(iterations)});
+    parser.add({'j', "jobs", "Format sections on N threads", int_flag(jobs)});
+    parser.add({"input", "Benchmark FILE instead of a generated song", [&input](auto optarg) {
+        input = optarg;
+    }});
+    parser.add({"compress", "Only this PDF compression, as in the song header, instead of each of "
+                            "none, text, metadata and all", [&options](auto optarg) {
+        if (!options.set(OptionId::compress, optarg)) {
+            fmt::print(stderr, "Invalid compression: {}\n", optarg);
+            std::exit(1);
+        }
+    }});
+    parser.add({"no-pdf", "Skip PDF generation", [&pdf]() { pdf = false; }});
+    parser.add_help("acchording-bench [args]");
+    parser.parse(argc, argv);
+
+    iterations = std::max(iterations, 1);
+
+    std::string song;
+    if (input.empty()) {
+        song = generate_song(cfg);
+    } else {
+        std::ifstream in(input, std::ios::binary);
+        if (!in) {
+            std::perror(input.c_str());
+            return 1;
+        }
+        song.assign(std::istreambuf_iterator<char>(in), {});
+    }
+
+    char song_fn[] = "/tmp/acchording-bench-XXXXXX";
+    int fd = mkstemp(song_fn);
+    if (fd < 0 || write(fd, song.data(), song.size()) != (ssize_t)song.size()) {
+        std::perror("acchording-bench");
+        return 1;
+    }
+    close(fd);
+    std::string pdf_fn = fmt::format("{}.pdf", song_fn);
+
+    using clock = std::chrono::steady_clock;
+
+    // Runs prepare() untimed, then measures fn()
+    auto measure = [&](Result &r, auto prepare, auto fn) {
+        for (int i = 0; i < iterations; i++) {
+            auto state = prepare();
+
+            size_t allocs = alloc_count, bytes = alloc_bytes;
+            auto beg = clock::now();
+            fn(state);
+            auto end = clock::now();
+
+            r.allocs += alloc_count - allocs;
+            r.alloc_bytes += alloc_bytes - bytes;
+            r.ns.push_back(std::chrono::duration<double, std::nano>(end - beg).count());
+        }
+    };
+
+    // Each PDF from libHaru and from the built-in writer, in every
+    // compression mode, so that size and time can be compared in one run
+    struct PdfRun {
+        const char *phase;
+        Options options;
+        long peak_rss_kb = 0;
+    };
+    std::vector<PdfRun> pdf_runs;
+    if (pdf) {
+        std::vector<opt::Compression> modes;
+        if (options.compress) {
+            modes.push_back(*options.compress);
+        } else {
+            for (const char *name : { "none", "text", "metadata", "all" })
+                opt::parse(name, modes.emplace_back());
+        }
+
+        for (const auto &mode : modes) {
+            for (bool native : { false, true }) {
+                Options opts = options;
+                opts.compress = mode;
+                opts.native_pdf = native;
+                pdf_runs.push_back({ native ? "print_formatted_pdf_native" : "print_formatted_pdf", opts });
+            }
+        }
+    }
+
+    auto fresh = []() { return std::make_unique<FileFormatter>(); };
+    auto parsed_with = [&](const Options &opts) {
+        auto ff = std::make_unique<FileFormatter>();
+        ff->set_jobs(std::max(jobs, 1));
+        ff->set_options(opts);
+        ff->init(song_fn);
+        return ff;
+    };
+    auto parsed = [&]() { return parsed_with(options); };
+
+    // Warnings about the synthetic input would only add noise
+    int saved_stderr = dup(STDERR_FILENO);
+    int devnull = open("/dev/null", O_WRONLY);
+    dup2(devnull, STDERR_FILENO);
+
+    // Keep libHaru's output away from stdout, which holds the JSON
+    auto silence_stdout = [devnull]() {
+        fflush(stdout);
+        int saved = dup(STDOUT_FILENO);
+        dup2(devnull, STDOUT_FILENO);
+        return saved;
+    };
+    auto restore_stdout = [](int saved) {
+        fflush(stdout);
+        dup2(saved, STDOUT_FILENO);
+        close(saved);
+    };
+
+    // Before anything is timed, while the bench's own heap is small
+    long init_rss = child_peak_rss(parsed);
+    if (pdf) {
+        int saved_stdout = silence_stdout();
+        for (auto &run : pdf_runs)
+            run.peak_rss_kb = child_peak_rss([&]() { parsed_with(run.options)->print_formatted_pdf(pdf_fn); });
+        restore_stdout(saved_stdout);
+    }
+
+    std::vector<Result> results;
+    results.reserve(2 + pdf_runs.size());
+
+    Result &init = results.emplace_back(Result{ .phase = "init", .bytes = song.size(), .peak_rss_kb = init_rss });
+    measure(init, fresh, [&](auto &ff) { ff->init(song_fn); });
+
+    Result &txt = results.emplace_back(Result{ .phase = "print_formatted_txt" });
+    measure(txt, parsed, [&](auto &ff) {
+        CountingBuf buf;
+        std::ostream out(&buf);
+        ff->print_formatted_txt(out);
+        txt.bytes = buf.bytes;
+    });
+
+    if (pdf) {
+        int saved_stdout = silence_stdout();
+
+        for (const auto &run : pdf_runs) {
+            Result &r = results.emplace_back(Result{ .phase = run.phase, .bytes = song.size(),
+                                                     .peak_rss_kb = run.peak_rss_kb,
+                                                     .compress = opt::to_string(*run.options.compress) });
+            measure(r, [&]() { return parsed_with(run.options); },
+                    [&](auto &ff) { ff->print_formatted_pdf(pdf_fn); });
+
+            struct stat st;
+            if (stat(pdf_fn.c_str(), &st) == 0)
+                r.output_bytes = st.st_size;
+        }
+
+        restore_stdout(saved_stdout);
+        unlink(pdf_fn.c_str());
+    }
+
+    dup2(saved_stderr, STDERR_FILENO);
+    close(saved_stderr);
+    close(devnull);
+    unlink(song_fn);
+
+    print_json(cfg, iterations, jobs, input, song.size(), results);
+}
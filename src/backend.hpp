@@ -0,0 +1,80 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <string>
+#include <string_view>
+
+struct PdfSettings;
+struct FontFiles;
+struct FontUsage;
+
+// Where a PDF goes: the file `fn`, stdout for "-", or `memory`
+struct PdfTarget {
+    std::string fn;
+    std::string *memory = nullptr;
+};
+
+// What PdfDocument draws with: the few PDF operators that text-only
+// pages need. Text is UTF-8 or Latin-1, as the settings say.
+class PdfBackend {
+public:
+    enum class Font : uint8_t { Body, Header, HeaderBold };
+    // Pages in the order they were added, whatever their place in the document
+    using PageId = size_t;
+
+    struct Rect {
+        float left, bottom, right, top;
+    };
+
+    virtual ~PdfBackend() = default;
+
+    // Ends the current page and starts a new one, at the end
+    // of the document or in front of the page `before`
+    virtual PageId add_page() = 0;
+    virtual PageId insert_page(PageId before) = 0;
+    virtual float page_width() const = 0;
+    virtual float page_height() const = 0;
+
+    virtual void set_font(Font font, float size) = 0;
+    virtual void set_text_leading(float leading) = 0;
+    virtual void begin_text() = 0;
+    virtual void end_text() = 0;
+    // At (x, y) of the page, within a text object
+    virtual void text_out(float x, float y, const std::string &text) = 0;
+    // Moves the start of the line
+    virtual void move_text_pos(float dx, float dy) = 0;
+    virtual void show_text(const std::string &text) = 0;
+    // Moves one leading down first
+    virtual void show_text_next_line(const std::string &text) = 0;
+
+    // In the current font and size
+    virtual float text_width(const std::string &text) = 0;
+    // Advance of `c` in thousandths of the font size, 0 if the backend can't tell
+    virtual int char_width(Font font, char32_t c) = 0;
+
+    // Drawing between begin_form() and end_form() goes into a form
+    // XObject with its origin at (0, 0) instead of onto the page. Forms
+    // are drawn any number of times, outside of text objects. Backends
+    // without forms leave these alone.
+    using FormId = size_t;
+    virtual bool has_forms() const { return false; }
+    virtual void begin_form() {}
+    virtual FormId end_form(Rect bbox) { (void)bbox; return 0; }
+    virtual void draw_form(FormId form, float x, float y) { (void)form, (void)x, (void)y; }
+
+    // Clicking `rect` on the current page goes to `dest`
+    virtual void add_link(Rect rect, PageId dest) = 0;
+    virtual void add_outline(const std::string &title, PageId page) = 0;
+
+    // Writes out what's left; throws on failure
+    virtual void finish() = 0;
+};
+
+// Both throw if the document can't be created
+std::unique_ptr<PdfBackend> make_haru_backend(const PdfSettings &settings, const FontFiles &fonts,
+                                              const FontUsage *usage, const PdfTarget &target);
+// Returns nullptr if the fonts can't be embedded, e.g. for CFF outlines
+std::unique_ptr<PdfBackend> make_native_backend(const PdfSettings &settings, const FontFiles &fonts,
+                                                const FontUsage &usage, const PdfTarget &target);
@@ -0,0 +1,221 @@
+#include <string>
+#include <string_view>
+
+#include "chord.hpp"
+
+// Parses a note name at the start of `s`: returns its length and
+// sets `semitone` and `flat`, or returns 0 if there is none
+static size_t parse_note(std::string_view s, int8_t &semitone, bool &flat)
+{
+    if (s.empty() || s[0] < 'A' || s[0] > 'G')
+        return 0;
+
+    int n = notes::letters[s[0] - 'A'];
+    flat = false;
+
+    size_t len = 1;
+    if (s.size() > 1 && s[1] == '#') {
+        n++;
+        len++;
+    } else if (s.size() > 1 && s[1] == 'b') {
+        n += 11;
+        flat = true;
+        len++;
+    }
+
+    semitone = n % 12;
+    return len;
+}
+
+Chord::Chord(std::string_view name)
+    : m_name(name)
+{
+    root_len = parse_note(name, root, root_flat);
+    if (root_len == 0) {
+        root = -1;
+        return;
+    }
+
+    // A bass note ends the chord
+    size_t slash = name.rfind('/');
+    if (slash == std::string_view::npos || slash < root_len)
+        return;
+
+    int8_t n;
+    bool flat;
+    size_t len = parse_note(name.substr(slash + 1), n, flat);
+    if (len > 0 && slash + 1 + len == name.size()) {
+        bass = n;
+        bass_flat = flat;
+        bass_pos = slash + 1;
+        bass_len = len;
+    }
+}
+
+bool Chord::is_chord(std::string_view s)
+{
+    int8_t n;
+    bool flat;
+    size_t len = parse_note(s, n, flat);
+    if (len == 0)
+        return false;
+    s.remove_prefix(len);
+
+    // Quality and extensions, e.g. "m7b5", "sus4", "maj9", "7(#11)"
+    static constexpr std::string_view words[] = {
+        "maj", "min", "dim", "aug", "sus", "add", "m", "M", "+", "-", "°", "ø", "(", ")", ",",
+    };
+    while (!s.empty() && s[0] != '/') {
+        if (s[0] >= '0' && s[0] <= '9') {
+            s.remove_prefix(1);
+            continue;
+        }
+        if ((s[0] == '#' || s[0] == 'b') && s.size() > 1 && s[1] >= '0' && s[1] <= '9') {
+            s.remove_prefix(2);
+            continue;
+        }
+
+        bool found = false;
+        for (std::string_view word : words) {
+            if (s.starts_with(word)) {
+                s.remove_prefix(word.size());
+                found = true;
+                break;
+            }
+        }
+        if (!found)
+            return false;
+    }
+
+    if (s.empty())
+        return true;
+
+    // Bass note
+    s.remove_prefix(1);
+    return parse_note(s, n, flat) == s.size() && !s.empty();
+}
+
+std::string_view Chord::transposed(const Transposition &t, std::string &buf) const
+{
+    if (root < 0 || t.semitones == 0)
+        return m_name;
+
+    auto note = [&t](int8_t semitone, bool written_flat) {
+        bool flat = t.spelling == Spelling::Flats
+            || (t.spelling == Spelling::AsWritten && written_flat);
+        return notes::names[flat][(semitone + t.semitones) % 12];
+    };
+
+    size_t rest_end = bass >= 0 ? bass_pos : m_name.size();
+
+    buf.clear();
+    buf.append(note(root, root_flat));
+    buf.append(m_name.substr(root_len, rest_end - root_len));
+    if (bass >= 0)
+        buf.append(note(bass, bass_flat));
+    return buf;
+}
+
+Spelling Chord::key_spelling(const Transposition &t) const
+{
+    if (root < 0)
+        return Spelling::AsWritten;
+
+    std::string_view quality = m_name.substr(root_len);
+    bool minor = quality.starts_with('m') && !quality.starts_with("maj");
+
+    // Minor keys are written like their relative major
+    int tonic = (root + t.semitones + (minor ? 3 : 0)) % 12;
+
+    // No accidentals in the key, keep those of the chords
+    if (tonic == 0)
+        return Spelling::AsWritten;
+    return notes::flat_keys[tonic] ? Spelling::Flats : Spelling::Sharps;
+}
+
+ChordId ChordTable::intern(std::string_view name)
+{
+    auto [it, inserted] = ids.try_emplace(name, (ChordId)chords.size());
+    if (inserted) {
+        chords.emplace_back(name);
+        transposed.emplace_back();
+        set_transposed(chords.size() - 1);
+    }
+    return it->second;
+}
+
+void ChordTable::transpose(const Transposition &t)
+{
+    if (t == key)
+        return;
+    key = t;
+
+    for (size_t i = 0; i < chords.size(); i++)
+        set_transposed(i);
+}
+
+void ChordTable::set_transposed(size_t i)
+{
+    std::string &buf = transposed[i];
+    if (chords[i].transposed(key, buf).data() != buf.data())
+        buf.clear();
+}
+
+void ChordLine::transposed(const Transposition &t, std::string &out, std::string &buf) const
+{
+    out.clear();
+    for (const auto &[col, chord] : chords) {
+        // Moved right where the chord before got longer
+        if (out.size() < col)
+            out.append(col - out.size(), ' ');
+        else if (!out.empty())
+            out.push_back(' ');
+        out.append(chord.transposed(t, buf));
+    }
+}
+
+// Bar lines and repeat marks that may stand between chords
+static bool is_chord_line_mark(std::string_view s)
+{
+    return s.find_first_not_of("|:/-.x0123456789") == std::string_view::npos;
+}
+
+std::vector<ChordLine> find_chord_lines(std::string_view text)
+{
+    std::vector<ChordLine> res;
+
+    size_t offset = 0;
+    while (offset <= text.size()) {
+        size_t nl = text.find('\n', offset);
+        if (nl == std::string_view::npos)
+            nl = text.size();
+        std::string_view line = text.substr(offset, nl - offset);
+
+        ChordLine cl = { offset, line.size(), {} };
+        bool chords = true, any = false;
+
+        size_t pos = 0;
+        while (chords) {
+            pos = line.find_first_not_of(" \t", pos);
+            if (pos == std::string_view::npos)
+                break;
+            size_t end = std::min(line.find_first_of(" \t", pos), line.size());
+            std::string_view word = line.substr(pos, end - pos);
+
+            if (Chord::is_chord(word))
+                any = true;
+            else if (!is_chord_line_mark(word))
+                chords = false;
+
+            cl.chords.emplace_back(pos, Chord(word));
+            pos = end;
+        }
+
+        if (chords && any)
+            res.push_back(std::move(cl));
+
+        offset = nl + 1;
+    }
+
+    return res;
+}
@@ -0,0 +1,106 @@
+#pragma once
+
+#include <array>
+#include <cstdint>
+#include <string>
+#include <string_view>
+#include <unordered_map>
+#include <vector>
+
+// How transposed notes are written
+enum class Spelling : uint8_t {
+    AsWritten, // Flat if the original note was
+    Sharps,
+    Flats,
+};
+
+struct Transposition {
+    int semitones = 0; // 0-11
+    Spelling spelling = Spelling::AsWritten;
+
+    bool operator==(const Transposition &) const = default;
+};
+
+namespace notes {
+
+// Semitones above C of the letters A-G
+constexpr std::array<int8_t, 7> letters = { 9, 11, 0, 2, 4, 5, 7 };
+
+// Name of each semitone, by [flat][semitone]
+constexpr std::array<std::array<std::string_view, 12>, 2> names = {{
+    { "C", "C#", "D", "D#", "E", "F", "F#", "G", "G#", "A", "A#", "B" },
+    { "C", "Db", "D", "Eb", "E", "F", "Gb", "G", "Ab", "A", "Bb", "B" },
+}};
+
+// Major keys written with flats, by their tonic
+constexpr std::array<bool, 12> flat_keys = {
+    false, true, false, true, false, true, false, false, true, false, true, false
+};
+
+}
+
+// A chord symbol, split up so that it can be transposed
+// without parsing it again: root, the rest, and a bass note
+// after '/'. Anything not starting with a note is kept as it is.
+// `name` has to outlive the Chord.
+class Chord {
+public:
+    explicit Chord(std::string_view name);
+
+    // Whether `s` is a chord symbol, for telling chord lines from lyrics
+    static bool is_chord(std::string_view s);
+
+    // The transposed name; `buf` holds it unless it's unchanged
+    std::string_view transposed(const Transposition &t, std::string &buf) const;
+
+    // Spelling of keys with this chord's root and quality
+    Spelling key_spelling(const Transposition &t) const;
+    std::string_view name() const { return m_name; }
+private:
+    std::string_view m_name;
+    int8_t root = -1;
+    int8_t bass = -1;
+    bool root_flat = false;
+    bool bass_flat = false;
+    uint8_t root_len = 0; // Letter and accidental
+    uint8_t bass_pos = 0;
+    uint8_t bass_len = 0;
+};
+
+using ChordId = uint32_t;
+
+// The distinct chords of a song, each parsed once and transposed
+// once per key, however often it is played
+class ChordTable {
+public:
+    // `name` has to outlive the table
+    ChordId intern(std::string_view name);
+
+    // Changes the key of name(); unlike name(), not while
+    // other threads may be reading
+    void transpose(const Transposition &t);
+    std::string_view name(ChordId id) const {
+        return transposed[id].empty() ? chords[id].name() : std::string_view(transposed[id]);
+    }
+private:
+    std::vector<Chord> chords;
+    std::unordered_map<std::string_view, ChordId> ids;
+    Transposition key;
+    std::vector<std::string> transposed; // In `key`, empty if unchanged
+
+    void set_transposed(size_t i);
+};
+
+// A line of chords in a section without a `chords:` list
+struct ChordLine {
+    size_t offset; // Of the line in the section text
+    size_t size;
+    // Columns in the line and the chords there
+    std::vector<std::pair<size_t, Chord>> chords;
+
+    // Whole line, chords placed at their columns where they fit
+    void transposed(const Transposition &t, std::string &out, std::string &buf) const;
+};
+
+// Chord lines among the lines of `text`
+std::vector<ChordLine> find_chord_lines(std::string_view text);
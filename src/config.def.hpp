@@ -1,6 +1,6 @@
 #pragma once
 
 #define ACCHORDING_BODY_FONT "Ubuntu Mono:Regular"
-#define ACCHORDING_BODY_FONT_SIZE "11"
+#define ACCHORDING_BODY_FONT_SIZE 11
 
 #define ACCHORDING_HEADER_FONT "Noto Sans"
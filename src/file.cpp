@@ -1,28 +1,40 @@
+#include <algorithm>
 #include <cassert>
+#include <cerrno>
 #include <cstring>
-#include <fstream>
 #include <iostream>
 #include <sstream>
+#include <span>
 #include <string>
 #include <string_view>
+#include <thread>
+#include <utility>
 
-#include <fmt/core.h>
-#include <fmt/ostream.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
 
-#include <hpdf.h>
+#include <fmt/core.h>
 
-#include "config.hpp"
 #include "file.hpp"
-#include "font.hpp"
+#include "pdf.hpp"
+#include "pool.hpp"
+#include "trace.hpp"
+#include "utf8.hpp"
 
-std::vector<Section> *Section::global_array = nullptr;
+// Below this, starting threads takes longer than formatting
+static constexpr size_t PARALLEL_MIN_SIZE = 64 * 1024;
 
-Section::Section(std::string_view sec)
+Section::Section(std::string_view sec, utf8::Encoding encoding, ChordTable &chord_table,
+                 std::pmr::memory_resource *mem)
+    : m_encoding(encoding), chord_table(&chord_table)
 {
     assert(sec.contains('[') && sec.contains(']'));
     assert(sec.starts_with('['));
 
-    name = sec.substr(1, sec.find(']')-1);
+    raw = sec;
+    m_name = sec.substr(1, sec.find(']')-1);
 
     // FIXME: find first non-empty and remove spaces up to there
     // copying from sites like Ultimate Guitar might produce
@@ -34,45 +46,41 @@ Section::Section(std::string_view sec)
 
     // Parse special commands
     while (true) {
-        if (name.starts_with('!')) {
+        if (m_name.starts_with('!')) {
             hide_name = true;
-            name.erase(name.begin());
-        } else if (name.starts_with('>')) {
-            type = Section::Type::Reproducible;
-            name.erase(name.begin());
-        } else if (name.starts_with('<')) {
-            type = Section::Type::Reproducing;
-            name.erase(name.begin());
-        } else if (name.starts_with('/')) {
+            m_name.remove_prefix(1);
+        } else if (m_name.starts_with('>')) {
+            m_type = Section::Type::Reproducible;
+            m_name.remove_prefix(1);
+        } else if (m_name.starts_with('<')) {
+            m_type = Section::Type::Reproducing;
+            m_name.remove_prefix(1);
+        } else if (m_name.starts_with('/')) {
             m_page_break = true;
-            name.erase(name.begin());
+            m_name.remove_prefix(1);
         } else {
             break;
         }
     }
 
     // Section needs or has no content
-    if (type == Section::Type::Reproducing || remainder_beg == sec.size()) {
-        text = "";
+    if (m_type == Section::Type::Reproducing || remainder_beg == sec.size()) {
         return;
     }
 
     std::string_view remainder = sec.substr(remainder_beg);
 
     if (remainder.starts_with("chords:")) {
-        // Have to copy to make stringstream
-        // (C++26 should have stringstream with string_view,
-        // in gcc yet?)
-        std::string chords_s(remainder.substr(remainder.find(':') + 1, remainder.find('\n') - (remainder.find(':')+1)));
+        std::string_view chords_s = remainder.substr(remainder.find(':') + 1, remainder.find('\n') - (remainder.find(':')+1));
 
-        chords.emplace(); // Initializes the optional queue
-
-        std::stringstream ss(chords_s);
-        std::string buf;
+        chords.emplace(mem); // Initializes the optional list
 
-        while (std::getline(ss, buf, ' ')) {
-            if (!buf.empty())
-                chords->push(buf);
+        // Space separated
+        while (!chords_s.empty()) {
+            size_t end = std::min(chords_s.find(' '), chords_s.size());
+            if (end > 0)
+                chords->push_back(chord_table.intern(chords_s.substr(0, end)));
+            chords_s.remove_prefix(std::min(end + 1, chords_s.size()));
         }
 
         if (chords->empty()) {
@@ -86,396 +94,789 @@ Section::Section(std::string_view sec)
         remainder.remove_suffix(1);
 
     text = remainder;
-    text.append("\n");
+    has_text = true;
 }
 
-void Section::print(std::ostream &out)
+// Removes the '>' markers from `line` into `lyrics` and puts the next
+// chord, names of chords[next], at each marker's column into `chord_line`, in one pass.
+//
+// The result is the same as starting with a line of spaces as long as
+// `line` and inserting each chord at its column, shifting the rest of the
+// line right: a chord whose column lies inside the previous chord ends up
+// inside it. Everything left of the last insertion never moves again, so
+// only the chords still being shifted (`pending`) need to be kept apart.
+static void place_chords(std::string_view line, utf8::Encoding encoding,
+                         std::span<const ChordId> chords, size_t &next, const ChordTable &names,
+                         std::string &chord_line, std::string &lyrics, std::string &pending)
 {
-    assert(global_array);
+    chord_line.clear(); // Fixed part of the chord line
+    lyrics.clear();
+    pending.clear();
+
+    size_t spaces = line.size(); // Trailing spaces after pending
+    size_t col = 0; // Column in lyrics
+
+    while (!line.empty()) {
+        // Text up to the next marker at once
+        if (line.front() != '>') {
+            std::string_view run = line.substr(0, line.find('>'));
+            lyrics.append(run);
+            // Bytes are columns unless it's UTF-8
+            col += encoding == utf8::Encoding::Utf8 ? utf8::columns(run) : run.size();
+            line.remove_prefix(run.size());
+            continue;
+        }
+        line.remove_prefix(1);
 
-    if (type == Section::Type::Reproducing) {
-        for (size_t j = 0; j < global_array->size(); j++) {
-            const Section &other = (*global_array)[j];
-            if (other.type == Section::Type::Reproducible && other.name == name) {
-                if (!other.output.has_value()) {
-                    fmt::print(stderr, "Warning: Attempting to reproduce [{}], which is undefined at this point\n", name);
-                    return;
-                }
-                out << other.output.value();
-                return;
-            }
+        std::string_view chord = "?";
+        if (next < chords.size())
+            chord = names.name(chords[next++]);
+
+        size_t k = col - chord_line.size();
+        if (k <= pending.size()) {
+            chord_line.append(pending, 0, k);
+            pending.erase(0, k);
+        } else {
+            chord_line.append(pending);
+            chord_line.append(k - pending.size(), ' ');
+            spaces -= k - pending.size();
+            pending.clear();
         }
-        fmt::print(stderr, "Warning: Trying to reproduce [{}], which was never defined\n", name);
+        pending.insert(0, chord);
+    }
+
+    chord_line.append(pending);
+    chord_line.append(spaces, ' ');
+}
+
+const SectionText *SectionCache::find(std::string_view raw, utf8::Encoding encoding,
+                                      const Transposition &t)
+{
+    auto it = entries.find(raw);
+    if (it == entries.end() || it->second.encoding != encoding || it->second.transposition != t)
+        return nullptr;
+
+    it->second.used = true;
+    return &it->second.formatted;
+}
+
+void SectionCache::insert(std::string_view raw, utf8::Encoding encoding, const Transposition &t,
+                          SectionText formatted)
+{
+    entries.insert_or_assign(std::string(raw), Entry{ encoding, t, std::move(formatted), true });
+}
+
+void SectionCache::prune()
+{
+    std::erase_if(entries, [](const auto &entry) { return !entry.second.used; });
+    for (auto &[raw, entry] : entries)
+        entry.used = false;
+}
+
+void Section::print(Layout &out, const Transposition &t, const Section *source, SectionCache *cache)
+{
+    if (m_type == Section::Type::Reproducing) {
+        if (!source) {
+            fmt::print(stderr, "Warning: Trying to reproduce [{}], which was never defined\n", m_name);
+        } else if (!source->output.has_value()) {
+            fmt::print(stderr, "Warning: Attempting to reproduce [{}], which is undefined at this point\n", m_name);
+        } else {
+            out.repeat(*source->output);
+        }
+        out.end_section(m_page_break);
         return;
     }
 
-    std::stringstream outs;
+    if (cache) {
+        if (const SectionText *formatted = cache->find(raw, m_encoding, t)) {
+            out.add(*formatted);
+            Layout::Range lines = out.end_section(m_page_break);
+            if (m_type == Section::Type::Reproducible)
+                output = lines;
+            return;
+        }
+    }
+
+    if (ahead) {
+        out.add(*ahead);
+        ahead.reset();
+    } else {
+        format(out, t);
+    }
+
+    Layout::Range lines = out.end_section(m_page_break);
+    if (m_type == Section::Type::Reproducible) {
+        output = lines;
+    }
+    if (cache) {
+        cache->insert(raw, m_encoding, t, out.copy(lines));
+    }
+}
+
+void Section::format_ahead(const Transposition &t)
+{
+    Layout tmp;
+    format(tmp, t);
+    ahead = tmp.copy(tmp.end_section(false));
+}
+
+void Section::format(Layout &out, const Transposition &t)
+{
+    using Kind = LayoutLine::Kind;
+
+    if (m_type == Section::Type::Reproducing)
+        return;
 
-    fmt::print(outs, "\n");
+    out.add(Kind::Blank, "");
 
     if (!hide_name)
-        fmt::print(outs, "[{}]\n", name);
+        out.print(Kind::Name, "[{}]", m_name);
 
     if (chords.has_value()) {
-        std::stringstream ss(text);
-        std::string buf;
+        std::string_view rest = text;
+
+        // Reused for every line, and by the next section on this thread
+        static thread_local std::string chord_line, lyrics, pending;
+        size_t next = 0;
 
-        while (std::getline(ss, buf)) {
-            std::string chord_line(buf.size(), ' ');
-            while (buf.contains('>')) {
-                // TODO: check if file is UTF-8
-                // Skips UTF-8 continuation bytes (starting with 0b10)
-                auto utf8_pos = [](const std::string &s, char c) {
-                    std::pair<size_t, size_t> poss; // 1. real pos, 2. effective pos
-                    for (poss.first = 0, poss.second = 0; s[poss.first] != c && poss.first < s.size(); poss.first++) {
-                        if ((s[poss.first] & 0b11000000) != 0b10000000) { // UTF-8 continuation char
-                            poss.second += 1;
-                        }
-                    }
-                    return poss;
-                };
-
-                auto poss = utf8_pos(buf, '>');
-
-                buf.erase(poss.first, 1);
-                
-                if (!chords->empty()) {
-                    chord_line.insert(poss.second, chords->front());
-                    chords->pop();
-                } else {
-                    chord_line.insert(poss.second, "?");
-                }
+        while (true) {
+            size_t nl = rest.find('\n');
+            place_chords(rest.substr(0, nl), m_encoding, *chords, next, *chord_table, chord_line, lyrics, pending);
+
+            out.add(Kind::Blank, "");
+            out.add(Kind::Chords, chord_line);
+            out.add(Kind::Lyrics, lyrics);
+
+            if (nl == std::string_view::npos)
+                break;
+            rest.remove_prefix(nl + 1);
+        }
+    } else if (has_text) {
+        out.add(Kind::Blank, "");
+
+        // Tagged as chords even when not transposed, for proportional fonts
+        if (!chord_lines)
+            chord_lines = find_chord_lines(text);
+
+        std::string line, buf;
+        size_t offset = 0;
+        for (const auto &cl : *chord_lines) {
+            if (cl.offset > offset)
+                out.add_lines(Kind::Text, text.substr(offset, cl.offset - 1 - offset));
+            if (t.semitones != 0) {
+                cl.transposed(t, line, buf);
+                out.add(Kind::Chords, line);
+            } else {
+                out.add(Kind::Chords, text.substr(cl.offset, cl.size));
             }
+            offset = cl.offset + cl.size + 1;
+        }
+        if (offset <= text.size())
+            out.add_lines(Kind::Text, text.substr(offset));
+    }
+}
+
+MappedFile::~MappedFile()
+{
+    if (m_data)
+        munmap((void*)m_data, m_size);
+}
+
+MappedFile::MappedFile(MappedFile &&other) noexcept
+    : m_data(std::exchange(other.m_data, nullptr))
+    , m_size(std::exchange(other.m_size, 0))
+{}
+
+MappedFile &MappedFile::operator=(MappedFile &&other) noexcept
+{
+    std::swap(m_data, other.m_data);
+    std::swap(m_size, other.m_size);
+    return *this;
+}
+
+bool MappedFile::open(const char *fn)
+{
+    int fd = ::open(fn, O_RDONLY);
+    if (fd < 0)
+        return false;
+
+    struct stat st;
+    if (fstat(fd, &st) < 0) {
+        close(fd);
+        return false;
+    }
+    if (S_ISDIR(st.st_mode)) {
+        close(fd);
+        errno = EISDIR;
+        return false;
+    }
 
-            fmt::print(outs, "\n{}\n{}\n", chord_line, buf);
+    // Can't map zero bytes, but there's nothing to read anyway
+    if (st.st_size > 0) {
+        void *p = mmap(nullptr, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+        if (p == MAP_FAILED) {
+            close(fd);
+            return false;
         }
-    } else if (!text.empty()) {
-        fmt::print(outs, "\n{}", text);
+        madvise(p, st.st_size, MADV_SEQUENTIAL);
+
+        m_data = (const char*)p;
+        m_size = st.st_size;
     }
 
-    if (type == Section::Type::Reproducible) {
-        output.emplace(outs.str());
+    close(fd);
+    return true;
+}
+
+// Splits off the first line of `rest`, like getline()
+static bool next_line(std::string_view &rest, std::string_view &line)
+{
+    if (rest.empty())
+        return false;
+
+    size_t nl = rest.find('\n');
+    line = rest.substr(0, nl);
+    rest.remove_prefix(nl == std::string_view::npos ? rest.size() : nl + 1);
+    return true;
+}
+
+// Whether `line` is the [Tag] of a section; warns
+// about lines that aren't, unless they are empty
+static bool is_tag_line(std::string_view line)
+{
+    if (line.empty())
+        return false;
+    if (!line.starts_with('[') || !line.ends_with(']')) {
+        fmt::print(stderr, "Warning: Line, \"{}\", does not provide a correct [Tag]\n", line);
+        return false;
+    }
+    if (line.length() <= 2) {
+        fmt::print(stderr, "Warning: Empty tag disregarded\n", line);
+        return false;
     }
-    out << outs.str();
+    return true;
+}
+
+// Where a section whose content starts `rest` ends in it:
+// at the next line starting with '[', npos if there is none.
+// Searches from `from` on, when what's before it was searched already.
+static size_t section_end(std::string_view rest, size_t from = 0)
+{
+    if (from == 0 && rest.starts_with('['))
+        return 0;
+    size_t end = rest.find("\n[", from);
+    return end == std::string_view::npos ? end : end + 1;
 }
 
-bool FileFormatter::is_valid_option(std::string_view opt)
+// Appends up to 64 KiB from `fd` to `buf`; returns 0 at the end, -1 on error
+static ssize_t read_more(int fd, std::string &buf)
 {
-    static_assert(FF_NOPTIONS == 10, "Update is_valid_option!");
+    constexpr size_t CHUNK = 64 * 1024;
+
+    size_t size = buf.size();
+    ssize_t n = 0;
+    buf.resize_and_overwrite(size + CHUNK, [fd, size, &n](char *p, size_t) {
+        do {
+            n = read(fd, p + size, CHUNK);
+        } while (n < 0 && errno == EINTR);
+        return size + std::max<ssize_t>(n, 0);
+    });
+    return n;
+}
 
-    return opt == FF_TITLE
-        || opt == FF_AUTHOR
-        || opt == FF_CAPO
-        || opt == FF_KEY
-        || opt == FF_TUNING
-        || opt == FF_SIZE
-        || opt == FF_BODY_FONT
-        || opt == FF_TITLE_FONT
-        || opt == FF_UTF8
-        || opt == FF_SPLIT;
+// Appends everything left in `fd` to `buf`; false on error
+static bool read_all(int fd, std::string &buf)
+{
+    ssize_t n;
+    while ((n = read_more(fd, buf)) > 0)
+        ;
+    return n == 0;
 }
 
-void FileFormatter::init(const char *fn)
+bool FileFormatter::init(const char *fn)
 {
+    // The whole song, from a pipe
+    if (std::string_view(fn) == "-") {
+        std::string data;
+        if (!read_all(STDIN_FILENO, data)) {
+            std::perror("stdin");
+            return false;
+        }
+        init_buffer(std::move(data));
+        return true;
+    }
+
     // Read file
-    std::ifstream f(fn);
-    if (!f.is_open()) {
+    {
+        trace::Span span("read file", fn);
+        if (!file.open(fn)) {
+            std::perror(fn);
+            return false;
+        }
+        span.add_bytes(file.view().size());
+    }
+
+    parse(file.view());
+    return true;
+}
+
+bool FileFormatter::init_copy(const char *fn)
+{
+    std::string data;
+    int fd = ::open(fn, O_RDONLY | O_CLOEXEC);
+    if (fd < 0 || !read_all(fd, data)) {
         std::perror(fn);
-        std::exit(1);
+        if (fd >= 0)
+            close(fd);
+        return false;
     }
+    close(fd);
+
+    init_buffer(std::move(data));
+    return true;
+}
 
-    std::string buf;
+bool FileFormatter::parse_header(std::string_view &rest, std::string_view &buf)
+{
+    trace::Span span("parse header");
+    const char *beg = rest.data();
+
+    bool found_tag = false;
 
     // Read meta info
-    while (std::getline(f, buf)) {
+    while (next_line(rest, buf)) {
         if (buf.empty())
             continue;
 
         // Song text begins
-        if (buf.starts_with('['))
+        if (buf.starts_with('[')) {
+            found_tag = true;
             break;
+        }
 
         if (!buf.contains(':')) {
             fmt::print(stderr, "Warning: Line, \"{}\", does not provide a property and a value\n", buf);
         } else {
             size_t sep = buf.find(':');
 
-            std::string prop(buf.begin(), buf.begin() + sep);
+            std::string_view prop = buf.substr(0, sep);
 
-            if (!is_valid_option(prop)) {
+            auto id = Options::find(prop);
+            if (!id) {
                 fmt::print(stderr, "Warning: Unrecognized header option \"{}\"\n", prop);
                 continue;
             }
 
             // Skip spaces
-            for (sep += 1; std::isspace(buf[sep]) && sep < buf.size(); sep++)
+            for (sep += 1; sep < buf.size() && std::isspace(buf[sep]); sep++)
                 ;
-            std::string_view value(buf.begin() + sep, buf.end());
+            std::string_view value = buf.substr(sep);
 
             // Prefer data already provided in command line
-            if (!metadata.contains(prop))
-                metadata[prop] = value;
+            if (!options.is_set(*id) && !options.set(*id, value))
+                fmt::print(stderr, "Warning: Invalid {} \"{}\", using the default\n", prop, value);
         }
     }
 
     // Load default values if they were neither
     // defined in command line nor in file
-    if (!metadata.contains(FF_TITLE)) {
+    if (!options.title) {
         fmt::print(stderr, "Warning: No title provided\n");
-        metadata[FF_TITLE] = "Untitled";
-    }
-    if (!metadata.contains(FF_SIZE))
-        metadata[FF_SIZE] = ACCHORDING_BODY_FONT_SIZE;
-    if (!metadata.contains(FF_BODY_FONT))
-        metadata[FF_BODY_FONT] = ACCHORDING_BODY_FONT;
-    if (!metadata.contains(FF_TITLE_FONT))
-        metadata[FF_TITLE_FONT] = ACCHORDING_HEADER_FONT;
-    if (!metadata.contains(FF_UTF8))
-        metadata[FF_UTF8] = "false";
-    if (!metadata.contains(FF_SPLIT))
-        metadata[FF_SPLIT] = "false";
-
-    if (!f) {
+        options.title = "Untitled";
+    }
+    // Text that needs it is shown as UTF-8 unless told otherwise
+    if (!options.utf8 && encoding == utf8::Encoding::Utf8)
+        options.utf8 = true;
+    options.fill(Options::defaults());
+
+    transposition = ((*options.transpose % 12) + 12) % 12;
+
+    span.add_bytes(rest.data() - beg);
+    return found_tag;
+}
+
+void FileFormatter::init_buffer(std::string data)
+{
+    trace::Span span("read file", "(buffer)");
+    span.add_bytes(data.size());
+
+    owned_data = std::make_unique<std::string>(std::move(data));
+    parse(*owned_data);
+}
+
+void FileFormatter::parse(std::string_view data)
+{
+    std::string_view rest = data;
+    std::string_view buf;
+
+    data_size = data.size();
+
+    {
+        trace::Span span("detect encoding");
+        span.add_bytes(data.size());
+        encoding = utf8::detect(data);
+    }
+
+    if (!parse_header(rest, buf)) {
         fmt::print(stderr, "Warning: File ended before any [Tags]\n");
         return;
     }
 
     // Read sections
-    
-    Section::global_array = &secs;
+
+    // Past the first invalid byte, sections count columns in bytes, as
+    // when streaming; the ones before it don't depend on what follows
+    utf8::Encoding so_far = encoding;
+    if (encoding == utf8::Encoding::Other)
+        so_far = utf8::detect(data.substr(0, buf.data() - data.data()));
 
     // We still have the first line in buf because
     // last loop ended because of it
     do {
-        if (buf.empty())
+        if (!is_tag_line(buf))
             continue;
-        if (!buf.starts_with('[') || !buf.ends_with(']')) {
-            fmt::print(stderr, "Warning: Line, \"{}\", does not provide a correct [Tag]\n", buf);
+
+        size_t end = std::min(section_end(rest), rest.size());
+
+        // The tag line and its content are contiguous in data
+        std::string_view sec(buf.data(), rest.data() + end - buf.data());
+        rest.remove_prefix(end);
+
+        trace::Span span("construct section", buf);
+        span.add_bytes(sec.size());
+
+        if (encoding == utf8::Encoding::Other)
+            so_far = utf8::join(so_far, utf8::detect(sec));
+
+        secs.push_back(Section(sec, so_far, storage->chords, &storage->arena));
+
+        // Reproductions refer to the first definition
+        if (secs.back().type() == Section::Type::Reproducible)
+            reproducible.try_emplace(secs.back().name(), secs.size() - 1);
+    } while (next_line(rest, buf));
+}
+
+void FileFormatter::format_ahead(const Transposition &t)
+{
+    trace::Span span("format ahead");
+
+    std::vector<Section *> todo;
+    for (auto &sec : secs) {
+        if (sec.type() == Section::Type::Reproducing)
             continue;
-        }
-        if (buf.length() <= 2) {
-            fmt::print(stderr, "Warning: Empty tag disregarded\n", buf);
+        if (section_cache && section_cache->find(sec.raw_text(), sec.encoding(), t))
             continue;
-        }
+        todo.push_back(&sec);
+    }
 
-        auto pos = f.tellg();
+    // Reproductions only refer to lines added in order later
+    parallel_for(todo.size(), jobs, [&](size_t i) { todo[i]->format_ahead(t); });
+}
 
-        std::stringbuf section_content;
-        f.get(section_content, '['); // getline() would extract the '['
+void FileFormatter::print_section(Layout &out, Section &sec, const Transposition &t)
+{
+    trace::Span span("print section", sec.name());
 
-        // Happens if section is empty
-        if (f.fail()) {
-            // A failed ifstream::get() puts the stream in a bad state
-            f.clear();
-            f.seekg(pos);
-        }
+    const Section *source = nullptr;
 
-        buf.push_back('\n'); // Was removed
-        buf.append(section_content.str());
+    if (sec.type() == Section::Type::Reproducing) {
+        if (auto it = reproducible.find(sec.name()); it != reproducible.end())
+            source = &secs[it->second];
+    }
 
-        secs.push_back(Section(buf));
-    } while (std::getline(f, buf));
+    sec.print(out, t, source, section_cache);
 }
 
 std::string FileFormatter::title()
 {
-    assert(metadata.contains(FF_TITLE));
-    if (metadata.contains(FF_AUTHOR))
-        return fmt::format("{} - {}", metadata.at(FF_AUTHOR), metadata.at(FF_TITLE));
+    assert(options.title);
+    if (options.author)
+        return fmt::format("{} - {}", *options.author, *options.title);
     else
-        return fmt::format("{}", metadata.at(FF_TITLE));
+        return *options.title;
 }
 
 std::string FileFormatter::subtitle()
+{
+    return subtitle(transposition_by(transposition));
+}
+
+std::string FileFormatter::subtitle(const Transposition &t)
 {
     std::stringstream ss;
     bool previous = false;
 
-    if (metadata.contains(FF_CAPO)) {
-        ss << fmt::format("Capo {}", metadata[FF_CAPO]);
+    if (options.capo) {
+        ss << fmt::format("Capo {}", *options.capo);
         previous = true;
     }
-    if (metadata.contains(FF_KEY)) {
+    if (options.key) {
+        if (previous)
+            ss << " - ";
+        std::string buf;
+        ss << fmt::format("Key {}", Chord(*options.key).transposed(t, buf));
+        previous = true;
+    } else if (t.semitones != 0) {
         if (previous)
             ss << " - ";
-        ss << fmt::format("Key {}", metadata[FF_KEY]);
+        ss << fmt::format("Transposed +{}", t.semitones);
         previous = true;
     }
-    if (metadata.contains(FF_TUNING)) {
+    if (options.tuning) {
         if (previous)
             ss << " - ";
-        ss << fmt::format("Tuning: {}", metadata[FF_TUNING]);
+        ss << fmt::format("Tuning: {}", *options.tuning);
     }
     return ss.str();
 }
 
-void FileFormatter::put_metadata(std::string_view key, std::string_view value)
+Transposition FileFormatter::transposition_by(int semitones)
 {
-    metadata[std::string(key)] = std::string(value);
+    Transposition t = { semitones % 12, Spelling::AsWritten };
+    // Accidentals follow the new key
+    if (options.key)
+        t.spelling = Chord(*options.key).key_spelling(t);
+    return t;
 }
 
-void FileFormatter::print_formatted_txt()
+void FileFormatter::add_header(Layout &out, const Transposition &t)
 {
-    fmt::print("{}\n", title());
-    auto sub = subtitle();
+    out.add(LayoutLine::Kind::Title, title());
+    auto sub = subtitle(t);
     if (!sub.empty())
-        fmt::print("{}\n", sub);
+        out.add(LayoutLine::Kind::Subtitle, sub);
+    out.end_header();
+}
+
+void FileFormatter::lay_out(Layout &out, const Transposition &t)
+{
+    // Reproductions refer to lines in `out`
+    for (auto &sec : secs)
+        sec.forget_output();
+    storage->chords.transpose(t);
+
+    // Large songs are formatted in parallel first, then put together in order
+    if (jobs > 1 && std::thread::hardware_concurrency() > 1 && data_size >= PARALLEL_MIN_SIZE)
+        format_ahead(t);
+
+    // Chord lines make the output up to about twice as long
+    out.reserve(2 * data_size);
+    add_header(out, t);
 
     for (auto &sec : secs) {
-        sec.print(std::cout);
+        print_section(out, sec, t);
     }
 }
 
-// https://github.com/libharu/libharu/wiki/Error-handling
-void error_handler(HPDF_STATUS error_no, HPDF_STATUS detail_no, void *user_data)
+const Layout &FileFormatter::layout()
 {
-    (void)user_data;
-    fmt::print(stderr, "hpdf: error_no={:x}, detail_no={}\n",
-      (unsigned int) error_no, (int) detail_no);
-    throw std::exception (); /* throw exception on error */
+    if (!laid_out) {
+        laid_out = true;
+        lay_out(m_layout, transposition_by(transposition));
+    }
+    return m_layout;
 }
 
-void FileFormatter::print_formatted_pdf(const std::string &fn)
+std::vector<SongVariant> FileFormatter::all_keys()
 {
-    assert(metadata.contains(FF_BODY_FONT)
-            && metadata.contains(FF_TITLE_FONT)
-            && metadata.contains(FF_UTF8)
-            && metadata.contains(FF_SIZE)
-            && metadata.contains(FF_SPLIT));
+    trace::Span span("all keys");
 
-    HPDF_Doc pdf = HPDF_New(error_handler, NULL);
+    std::vector<SongVariant> res(12);
+    for (int k = 0; k < 12; k++) {
+        Transposition t = transposition_by(transposition + k);
+        SongVariant &v = res[k];
 
-    if (!pdf) {
-        fmt::print(stderr, "hpdf: cannot create document\n");
-        return;
+        if (options.key) {
+            std::string buf;
+            v.label = fmt::format("Key {}", Chord(*options.key).transposed(t, buf));
+        } else if (t.semitones == 0) {
+            v.label = "Original";
+        } else {
+            v.label = fmt::format("Transposed +{}", t.semitones);
+        }
+        v.title = title();
+        v.subtitle = subtitle(t);
+        lay_out(v.layout, t);
     }
+    return res;
+}
 
-    std::string body_font_file;
-    std::string header_font_file;
-    std::string header_bold_font_file;
-
-    {
-        FontMatcher fm;
-
-        // These shouldn't fail, as fontconfig will just default
-        // back to another font if it can't find a match
-        body_font_file = fm.match_name(metadata[FF_BODY_FONT]);
-        header_font_file = fm.match_name(fmt::format("{}:Regular", metadata[FF_TITLE_FONT]));
-        header_bold_font_file = fm.match_name(fmt::format("{}:Bold", metadata[FF_TITLE_FONT]));
-
-        fmt::print("Body font: {}\n", body_font_file);
-        fmt::print("Header font: {}\n", header_font_file);
-        fmt::print("Header font (bold): {}\n", header_bold_font_file);
+bool FileFormatter::stream(int in, int out)
+{
+    std::string data; // Read, but not written out yet
+    bool eof = false;
+    auto read_input = [&]() {
+        trace::Span span("read file", "(stream)");
+        ssize_t n = read_more(in, data);
+        if (n < 0) {
+            std::perror("stdin");
+            return false;
+        }
+        span.add_bytes(n);
+        eof = n == 0;
+        return true;
+    };
+    // Reads until `data` has a whole line from `from` on, or the input ended
+    auto read_line = [&](size_t from) {
+        while (!eof && data.find('\n', from) == std::string::npos) {
+            from = data.size();
+            if (!read_input())
+                return false;
+        }
+        return true;
+    };
+    // Reads until the section with content from `body` on is complete, or
+    // the input ended, and sets `end` to where it ends. Only what was read
+    // since the last search is searched again, so long sections stay linear.
+    auto read_section = [&](size_t body, size_t &end) {
+        size_t from = 0;
+        while ((end = section_end(std::string_view(data).substr(body), from)) == std::string::npos && !eof) {
+            // A "\n[" may straddle the end of what was searched
+            from = std::max<size_t>(data.size() - body, 1) - 1;
+            if (!read_input())
+                return false;
+        }
+        return true;
+    };
+
+    // Header, up to the first [Tag] line
+    size_t tag;
+    if (!read_section(0, tag))
+        return false;
+    if (!read_line(std::min(tag, data.size())))
+        return false;
+
+    std::string_view rest = data, buf;
+    bool found_tag = parse_header(rest, buf);
+    Transposition t = transposition_by(transposition);
+
+    Layout layout;
+    add_header(layout, t);
+    if (!layout.write_to(out))
+        return false;
+    if (!found_tag) {
+        fmt::print(stderr, "Warning: File ended before any [Tags]\n");
+        return true;
     }
-
-    // TODO: unify checking metadata boolean value
-    bool split_page = (metadata[FF_SPLIT] == "true") || (metadata[FF_SPLIT] == "1");
-    bool use_utf8 = (metadata[FF_UTF8] == "true") || (metadata[FF_UTF8] == "1");
-    int body_font_size = std::stoi(metadata[FF_SIZE]);
-
-    try {
-        if (use_utf8) {
-            HPDF_UseUTFEncodings(pdf);
-            HPDF_SetCurrentEncoder(pdf, "UTF-8");
+    // Sections count columns in bytes from the first invalid one on
+    utf8::Encoding so_far = utf8::detect(std::string_view(data).substr(0, buf.data() - data.data()));
+    data.erase(0, buf.data() - data.data());
+
+    // Output of [>Name] sections, for reproducing them later
+    std::unordered_map<std::string, SectionText> reproducible;
+    std::pmr::monotonic_buffer_resource arena;
+
+    // `data` starts with a whole line, the next [Tag] unless it's invalid
+    while (!data.empty()) {
+        size_t nl = data.find('\n');
+        size_t body = std::min(nl, data.size() - 1) + 1;
+
+        if (!is_tag_line(std::string_view(data).substr(0, nl))) {
+            data.erase(0, body);
+            if (!read_line(0))
+                return false;
+            continue;
         }
 
-        HPDF_Page page = HPDF_AddPage(pdf);
-        
-        HPDF_REAL height;
-        height = HPDF_Page_GetHeight(page);
-
-        int pos = height - 50;
-
-        const int left_margin = 50;
-
-        const char *font_name;
-        HPDF_Font def_font;
-
-        // Title
-        std::string header = title();
-
-        font_name = HPDF_LoadTTFontFromFile(pdf, header_bold_font_file.c_str(), HPDF_TRUE);
-        def_font = HPDF_GetFont(pdf, font_name, use_utf8 ? "UTF-8" : NULL);
-        HPDF_Page_SetFontAndSize(page, def_font, 18);
-
-        HPDF_Page_BeginText(page);
-        HPDF_Page_TextOut(page, left_margin, pos, header.c_str());
-        HPDF_Page_EndText(page);
-
-        // Sub header
-        std::string sub_header = subtitle();
-
-        font_name = HPDF_LoadTTFontFromFile(pdf, header_font_file.c_str(), HPDF_TRUE);
-        def_font = HPDF_GetFont(pdf, font_name, use_utf8 ? "UTF-8" : NULL);
-        HPDF_Page_SetFontAndSize(page, def_font, 12);
-
-        HPDF_Page_BeginText(page);
-        HPDF_Page_TextOut(page, left_margin, (pos -= 20), sub_header.c_str());
-        HPDF_Page_EndText(page);
-
-        // Sections
-        HPDF_Page_BeginText(page);
-        HPDF_Page_MoveTextPos(page, left_margin, (pos -= 10));
+        // A section is complete once the next one starts
+        size_t end;
+        if (!read_section(body, end))
+            return false;
+        end = end == std::string::npos ? data.size() : body + end;
+
+        {
+            std::string_view raw = std::string_view(data).substr(0, end);
+            // Nothing outlives the section, so that memory
+            // doesn't grow with the length of the input
+            ChordTable chords;
+            chords.transpose(t);
+            so_far = utf8::join(so_far, utf8::detect(raw));
+            Section sec(raw, so_far, chords, &arena);
+
+            trace::Span span("print section", sec.name());
+            layout.clear();
+
+            if (sec.type() == Section::Type::Reproducing) {
+                auto it = reproducible.find(std::string(sec.name()));
+                if (it == reproducible.end())
+                    fmt::print(stderr, "Warning: Attempting to reproduce [{}], which is undefined at this point\n", sec.name());
+                else
+                    layout.add(it->second);
+                layout.end_section(sec.page_break());
+            } else {
+                sec.print(layout, t);
+                // Reproductions refer to the first definition
+                if (sec.type() == Section::Type::Reproducible && !reproducible.contains(std::string(sec.name())))
+                    reproducible.emplace(sec.name(), layout.copy(layout.sections().back().lines));
+            }
+        }
+        arena.release();
 
-        font_name = HPDF_LoadTTFontFromFile(pdf, body_font_file.c_str(), HPDF_TRUE);
-        def_font = HPDF_GetFont(pdf, font_name, use_utf8 ? "UTF-8" : NULL);
+        if (!layout.write_to(out))
+            return false;
 
-        const HPDF_REAL split_page_right_x = HPDF_Page_GetWidth(page) / 2;
-        bool split_page_right = false;
-        int starting_pos = pos;
+        data.erase(0, end);
+        if (!read_line(0))
+            return false;
+    }
 
-        auto next_page = [&]() {
-            // Write right half of page
-            if (split_page && !split_page_right) {
-                HPDF_Page_EndText(page);
-                HPDF_Page_BeginText(page);
+    return true;
+}
 
-                HPDF_Page_MoveTextPos(page, split_page_right_x, starting_pos);
-            } else {
-                HPDF_Page_EndText(page);
-                page = HPDF_AddPage(pdf);
+void FileFormatter::print_formatted_txt(std::ostream &out)
+{
+    layout().write_to(out);
+}
 
-                HPDF_Page_BeginText(page);
+PdfSettings FileFormatter::pdf_settings()
+{
+    assert(options.body_font && options.title_font && options.size && options.utf8 && options.split
+            && options.compress && options.native_pdf);
+
+    return {
+        .body_font = *options.body_font,
+        .title_font = *options.title_font,
+        .size = *options.size,
+        .utf8 = *options.utf8,
+        .split = *options.split,
+        .compress = *options.compress,
+        .native = *options.native_pdf,
+    };
+}
 
-                pos = height - 30;
-                HPDF_Page_MoveTextPos(page, left_margin, pos);
-                HPDF_Page_SetFontAndSize(page, def_font, body_font_size);
-            }
+// Lays out `ff` in a new document written to `target`
+static void render_pdf(FileFormatter &ff, const FontFiles *fonts, const PdfTarget &target)
+{
+    std::string title = ff.title();
+    std::string subtitle = ff.subtitle();
+    const Layout &layout = ff.layout();
 
-            if (split_page) { // probably acceptable overhead when
-                              // not splitting
-                split_page_right = !split_page_right;
-                starting_pos = height - 30; // if not first page
-            }
-        };
+    FontUsage usage;
+    usage.add_song(title, subtitle, layout);
 
-        HPDF_Page_SetFontAndSize(page, def_font, body_font_size);
-        for (auto &sec : secs) {
-            std::stringstream ss;
-            sec.print(ss);
+    PdfDocument doc(ff.pdf_settings(), target, fonts, &usage);
+    doc.add_song(title, subtitle, layout);
+    doc.finish();
+}
 
-            std::string buf;
-            while (std::getline(ss, buf)) {
-                // Page is full, go to next
-                if (HPDF_Point p = HPDF_Page_GetCurrentTextPos(page); p.y < 50) {
-                    next_page();
-                }
-
-                HPDF_Page_ShowText(page, buf.c_str());
-                HPDF_Page_MoveTextPos(page, 0, -(body_font_size+2));
-            }
+bool FileFormatter::print_formatted_pdf(const std::string &fn, const FontFiles *fonts)
+{
+    try {
+        render_pdf(*this, fonts, { fn });
+    } catch (...) {
+        return false;
+    }
 
-            if (sec.page_break()) {
-                next_page();
-            }
-        }
-        HPDF_Page_EndText(page);
+    return true;
+}
 
-        HPDF_SaveToFile(pdf, fn.c_str());
+std::optional<std::string> FileFormatter::formatted_pdf(const FontFiles *fonts)
+{
+    try {
+        std::string res;
+        render_pdf(*this, fonts, { "", &res });
+        return res;
     } catch (...) {
-        HPDF_Free(pdf);
-        return;
+        return std::nullopt;
     }
-
-    HPDF_Free (pdf);
 }
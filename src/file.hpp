@@ -1,25 +1,63 @@
 #pragma once
 
+#include <iostream>
 #include <optional>
-#include <map>
-#include <queue>
+#include <memory>
+#include <memory_resource>
 #include <string>
+#include <string_view>
+#include <unordered_map>
 #include <vector>
 
-// INCREASE FOR NEW OPTION
-#define FF_NOPTIONS     10
-// Data printed out
-#define FF_TITLE 		"title"
-#define FF_AUTHOR 		"author"
-#define FF_CAPO 		"capo"
-#define FF_KEY      	"key"
-#define FF_TUNING 		"tuning"
-// Options for PDF generation
-#define FF_SIZE 		"size" // int
-#define FF_BODY_FONT 	"body-font"
-#define FF_TITLE_FONT	"title-font"
-#define FF_UTF8 		"utf8" // Should have value 'true' or '1', everything else is valued as false
-#define FF_SPLIT 		"split" // Should have value 'true' or '1', everything else is valued as false
+#include "chord.hpp"
+#include "layout.hpp"
+#include "options.hpp"
+#include "utf8.hpp"
+
+// Read-only view of a whole file, memory-mapped
+class MappedFile {
+public:
+    MappedFile() = default;
+    ~MappedFile();
+
+    MappedFile(MappedFile &&other) noexcept;
+    MappedFile &operator=(MappedFile &&other) noexcept;
+
+    // Returns false and sets errno on failure
+    bool open(const char *fn);
+
+    std::string_view view() const { return { m_data, m_size }; }
+private:
+    const char *m_data = nullptr;
+    size_t m_size = 0;
+};
+
+// Formatted output of sections, keyed by their text, so that
+// sections that didn't change aren't formatted again
+class SectionCache {
+public:
+    const SectionText *find(std::string_view raw, utf8::Encoding encoding, const Transposition &t);
+    void insert(std::string_view raw, utf8::Encoding encoding, const Transposition &t,
+                SectionText formatted);
+
+    // Drops the entries that weren't used since the last prune()
+    void prune();
+private:
+    struct Entry {
+        // Columns are counted by the encoding, which depends on the rest of the file
+        utf8::Encoding encoding;
+        Transposition transposition;
+        SectionText formatted;
+        bool used;
+    };
+
+    struct Hash {
+        using is_transparent = void;
+        size_t operator()(std::string_view s) const { return std::hash<std::string_view>()(s); }
+    };
+
+    std::unordered_map<std::string, Entry, Hash, std::equal_to<>> entries;
+};
 
 class Section {
 public:
@@ -29,43 +67,147 @@ public:
         Reproducing
     };
 
-    Section(std::string_view sec);
-    void print(std::ostream &out);
-
+    // `sec` spans the tag line and the content, in `encoding`;
+    // it and `chord_table` have to outlive the Section
+    Section(std::string_view sec, utf8::Encoding encoding, ChordTable &chord_table,
+            std::pmr::memory_resource *mem);
+    // Adds the section's lines to `out` and ends it there. `source` is
+    // the section a Reproducing one copies, nullptr if there is none.
+    // The chord table has to be transposed by `t` already.
+    void print(Layout &out, const Transposition &t, const Section *source = nullptr,
+               SectionCache *cache = nullptr);
+    // Adds the section's own lines to `out`, without ending the
+    // section there; does nothing for Reproducing ones
+    void format(Layout &out, const Transposition &t);
+    // Formats the section for print() to add later; can run on
+    // any thread, as long as only one handles this section
+    void format_ahead(const Transposition &t);
+    // Before printing into a new Layout
+    void forget_output() { output.reset(); }
+
+    Type type() const { return m_type; }
+    std::string_view name() const { return m_name; }
+    std::string_view raw_text() const { return raw; }
+    utf8::Encoding encoding() const { return m_encoding; }
     bool page_break() const { return m_page_break; }
 
-    // This is for accessing the other sections
-    // when reaccessing a prior defined one
-    static std::vector<Section> *global_array;
-
 private:
-    Type type = Type::Normal;
-
-    std::string name;
-    std::optional<std::queue<std::string>> chords;
-    std::string text;
+    Type m_type = Type::Normal;
+
+    std::string_view raw; // Tag line and content
+    utf8::Encoding m_encoding;
+    std::string_view m_name;
+    const ChordTable *chord_table;
+    std::optional<std::pmr::vector<ChordId>> chords;
+    std::string_view text; // Without trailing whitespace
+    bool has_text = false;
+    // Chord lines in text, found when first formatted
+    std::optional<std::vector<ChordLine>> chord_lines;
 
     bool hide_name = false; // Hide tag name
-    std::optional<std::string> output; // For reproducing later
+    std::optional<Layout::Range> output; // For reproducing later
+    std::optional<SectionText> ahead; // From format_ahead()
 
     bool m_page_break = false;
 };
 
-class FileFormatter {
-public:
-    void init(const char *fn);
+// Options for PDF generation, with the defaults filled in
+struct PdfSettings {
+    std::string body_font;
+    std::string title_font;
+    int size;
+    bool utf8;
+    bool split;
+    opt::Compression compress;
+    bool native; // Built-in PDF writer instead of libHaru
+
+    bool operator==(const PdfSettings &) const = default;
+};
 
-    void put_metadata(std::string_view key, std::string_view value);
+struct FontFiles;
 
-    void print_formatted_txt();
-    void print_formatted_pdf(const std::string &fn);
-private:
-    std::map<std::string, std::string> metadata;
-
-    std::vector<Section> secs;
+// A song in another key
+struct SongVariant {
+    std::string label; // e.g. "Key D"
+    std::string title;
+    std::string subtitle;
+    Layout layout;
+};
 
-    static bool is_valid_option(std::string_view opt);
+class FileFormatter {
+public:
+    // Returns false if the file could not be read; "-" reads stdin
+    bool init(const char *fn);
+    // Like init(), but copies the file instead of mapping it, for files
+    // that an editor may truncate while they are read
+    bool init_copy(const char *fn);
+    // Song text in memory instead of a file
+    void init_buffer(std::string data);
+
+    // Options given elsewhere, which the song header doesn't override
+    void set_options(const Options &o) { options = o; }
+
+    // Reuse formatted sections from, and add them to, `cache`
+    void set_section_cache(SectionCache *cache) { section_cache = cache; }
+    // Format the sections of large songs on up to `jobs` threads
+    void set_jobs(unsigned jobs) { this->jobs = jobs; }
+
+    void print_formatted_txt(std::ostream &out = std::cout);
+    // Reads the song from `in` and writes it as text to `out` section by
+    // section, as soon as each is complete, keeping only the output of
+    // [>Name] sections. Returns false on read or write errors.
+    bool stream(int in, int out);
+    // Returns false if the PDF could not be written; "-" writes to stdout.
+    // Fonts are resolved unless `fonts` is given.
+    bool print_formatted_pdf(const std::string &fn, const FontFiles *fonts = nullptr);
+    // The PDF file's contents, nothing if it could not be generated
+    std::optional<std::string> formatted_pdf(const FontFiles *fonts = nullptr);
 
     std::string title();
     std::string subtitle();
+
+    // Formats the song on first use
+    const Layout &layout();
+    // The song in all 12 keys, starting with its own
+    std::vector<SongVariant> all_keys();
+    PdfSettings pdf_settings();
+private:
+    Options options;
+
+    MappedFile file;
+    // Set by init_buffer(), on the heap so that it doesn't move
+    std::unique_ptr<std::string> owned_data;
+    size_t data_size = 0;
+    utf8::Encoding encoding = utf8::Encoding::Ascii;
+    int transposition = 0; // 0-11
+    // What sections are parsed into, freed all at once; on
+    // the heap so that sections can keep pointing into it
+    struct Storage {
+        std::pmr::monotonic_buffer_resource arena;
+        ChordTable chords;
+    };
+    std::unique_ptr<Storage> storage = std::make_unique<Storage>();
+    std::pmr::vector<Section> secs{ &storage->arena };
+    // Name -> index of the Reproducible section in secs
+    std::pmr::unordered_map<std::string_view, size_t> reproducible{ &storage->arena };
+
+    SectionCache *section_cache = nullptr;
+    unsigned jobs = 1;
+
+    Layout m_layout;
+    bool laid_out = false;
+
+    // Parses header and sections, which will point into data
+    void parse(std::string_view data);
+    // Consumes the header from `rest`; returns whether a
+    // [Tag] follows, which is then left in `buf`
+    bool parse_header(std::string_view &rest, std::string_view &buf);
+
+    Transposition transposition_by(int semitones);
+    std::string subtitle(const Transposition &t);
+    void add_header(Layout &out, const Transposition &t);
+    void lay_out(Layout &out, const Transposition &t);
+    // Formats the sections not in the cache in parallel
+    void format_ahead(const Transposition &t);
+    void print_section(Layout &out, Section &sec, const Transposition &t);
 };
@@ -1,15 +1,57 @@
+#include <charconv>
 #include <cstdlib>
+#include <filesystem>
+#include <fstream>
 #include <iostream>
+#include <sstream>
 #include <string>
 
+#include <sys/stat.h>
+#include <unistd.h>
+
 #include <fontconfig/fontconfig.h>
 
 #include <fmt/core.h>
+#include <fmt/ostream.h>
 
 #include "font.hpp"
+#include "trace.hpp"
+
+#define FONT_CACHE_MAGIC "acchording-fontcache 1"
+
+// Nanosecond mtime, or -1 if the path doesn't exist
+static int64_t mtime_of(const std::string &path)
+{
+    struct stat st;
+    if (stat(path.c_str(), &st) != 0)
+        return -1;
+    return (int64_t)st.st_mtim.tv_sec * 1000000000 + st.st_mtim.tv_nsec;
+}
 
 FontMatcher::FontMatcher()
 {
+    if (const char *xdg = std::getenv("XDG_CACHE_HOME"); xdg && *xdg)
+        cache_path = fmt::format("{}/acchording/fonts", xdg);
+    else if (const char *home = std::getenv("HOME"); home && *home)
+        cache_path = fmt::format("{}/.cache/acchording/fonts", home);
+
+    load_cache();
+}
+
+FontMatcher::~FontMatcher()
+{
+    if (cache_dirty)
+        save_cache();
+
+    if (config)
+        FcFini();
+}
+
+void FontMatcher::init_fontconfig()
+{
+    if (config)
+        return;
+
     if (!FcInit()) {
         fmt::print("fontconfig: FcInit() failed, aborting!\n");
         std::exit(1);
@@ -17,11 +59,99 @@ FontMatcher::FontMatcher()
 
     config = FcConfigGetCurrent();
     FcConfigSetRescanInterval(config, 0);
+
+    // Remember the state of fontconfig's own cache
+    // that the entries we add are based on
+    cache_dirs.clear();
+
+    FcStrList *dirs = FcConfigGetCacheDirs(config);
+    if (!dirs)
+        return;
+
+    const char *home = std::getenv("HOME");
+    while (FcChar8 *dir = FcStrListNext(dirs)) {
+        std::string path((char*)dir);
+        if (path.starts_with("~/") && home)
+            path.replace(0, 1, home);
+        cache_dirs.emplace_back(path, mtime_of(path));
+    }
+    FcStrListDone(dirs);
 }
 
-FontMatcher::~FontMatcher()
+void FontMatcher::load_cache()
 {
-    FcFini();
+    if (cache_path.empty())
+        return;
+
+    std::ifstream f(cache_path);
+    if (!f.is_open())
+        return;
+
+    std::string buf;
+    if (!std::getline(f, buf) || buf != FONT_CACHE_MAGIC)
+        return;
+
+    std::vector<std::pair<std::string, int64_t>> dirs;
+    std::map<Query, std::string> entries;
+
+    while (std::getline(f, buf)) {
+        std::vector<std::string> fields;
+        std::stringstream ss(buf);
+        std::string field;
+        while (std::getline(ss, field, '\t'))
+            fields.push_back(field);
+
+        int64_t mtime;
+        if (fields.size() == 3 && fields[0] == "dir"
+                && std::from_chars(fields[2].data(), fields[2].data() + fields[2].size(), mtime).ec == std::errc()) {
+            // A font was added or removed since the entries were written
+            if (mtime_of(fields[1]) != mtime)
+                return;
+            dirs.emplace_back(fields[1], mtime);
+        } else if (fields.size() == 5 && fields[0] == "font") {
+            entries[{fields[1], fields[2], fields[3]}] = fields[4];
+        } else {
+            fmt::print(stderr, "Warning: Ignoring malformed font cache {}\n", cache_path);
+            return;
+        }
+    }
+
+    cache_dirs = std::move(dirs);
+    cache = std::move(entries);
+}
+
+void FontMatcher::save_cache()
+{
+    if (cache_path.empty())
+        return;
+
+    std::filesystem::path path(cache_path);
+
+    std::error_code ec;
+    std::filesystem::create_directories(path.parent_path(), ec);
+
+    // Write to a temporary file first, so that concurrent
+    // runs never see a partially written cache
+    std::string tmp_path = fmt::format("{}.{}", cache_path, getpid());
+
+    {
+        std::ofstream f(tmp_path);
+        if (!f.is_open())
+            return;
+
+        fmt::print(f, "{}\n", FONT_CACHE_MAGIC);
+        for (const auto &[dir, mtime] : cache_dirs)
+            fmt::print(f, "dir\t{}\t{}\n", dir, mtime);
+        for (const auto &[query, file] : cache)
+            fmt::print(f, "font\t{}\t{}\t{}\t{}\n", std::get<0>(query), std::get<1>(query), std::get<2>(query), file);
+
+        if (!f)
+            return;
+    }
+
+    std::filesystem::rename(tmp_path, path, ec);
+    if (ec)
+        std::filesystem::remove(tmp_path, ec);
 }
 
 std::string FontMatcher::get_matching_font(FcPattern *pat)
@@ -55,30 +185,42 @@ std::string FontMatcher::get_matching_font(FcPattern *pat)
 
 std::string FontMatcher::match_name(std::string name)
 {
-    std::string res;
+    trace::Span span("match font", name);
 
-    FcChar8* family = (FcChar8*)name.c_str();
+    std::string res;
 
     // Split the string into Family and Style
     // if they appear separated by ':'
-    FcChar8* style = NULL;
+    std::string family = name;
+    std::string style = "Regular";
     if (size_t pos = name.find(':'); pos != std::string::npos) {
-        name[pos] = '\0';
-        style = (FcChar8*)(name.c_str() + pos + 1);
-    } else {
-        style = (FcChar8*)"Regular";
+        family = name.substr(0, pos);
+        style = name.substr(pos + 1);
     }
 
+    Query query(family, style, "TrueType");
+
+    // The cached file may have been removed since
+    if (auto it = cache.find(query); it != cache.end() && mtime_of(it->second) != -1)
+        return it->second;
+
+    init_fontconfig();
+
     // Matches .ttf fonts with the given name and style
     FcPattern *pat = FcPatternBuild (0,
-                                     FC_FAMILY, FcTypeString, family,
-                                     FC_STYLE, FcTypeString, style,
-                                     FC_FONTFORMAT, FcTypeString, "TrueType",
+                                     FC_FAMILY, FcTypeString, (FcChar8*)family.c_str(),
+                                     FC_STYLE, FcTypeString, (FcChar8*)style.c_str(),
+                                     FC_FONTFORMAT, FcTypeString, std::get<2>(query).c_str(),
                                      (char *) 0);
 
 
     res = get_matching_font(pat);
     FcPatternDestroy(pat);
 
+    if (!res.empty()) {
+        cache[query] = res;
+        cache_dirty = true;
+    }
+
     return res;
 }
@@ -1,9 +1,16 @@
 #pragma once
 
+#include <cstdint>
+#include <map>
 #include <string>
+#include <tuple>
+#include <vector>
 
 #include <fontconfig/fontconfig.h>
 
+// Resolves font names to files. Results are kept in a cache file
+// ($XDG_CACHE_HOME/acchording/fonts), so fontconfig is only
+// initialized when a name has not been resolved before.
 class FontMatcher {
 public:
     FontMatcher();
@@ -11,7 +18,22 @@ public:
 
     std::string match_name(std::string name);
 private:
+    // family, style, format
+    using Query = std::tuple<std::string, std::string, std::string>;
+
     std::string get_matching_font(FcPattern *pat);
 
-    FcConfig *config;
+    void init_fontconfig();
+
+    void load_cache();
+    void save_cache();
+
+    FcConfig *config = nullptr;
+
+    std::string cache_path;
+    std::map<Query, std::string> cache;
+    // fontconfig's cache directories and their mtimes
+    // when the cache was written; any change invalidates it
+    std::vector<std::pair<std::string, int64_t>> cache_dirs;
+    bool cache_dirty = false;
 };
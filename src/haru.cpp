@@ -0,0 +1,277 @@
+#include <algorithm>
+#include <cerrno>
+#include <cstdio>
+#include <exception>
+#include <map>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+#include <fmt/core.h>
+
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <hpdf.h>
+
+#include "backend.hpp"
+#include "pdf.hpp"
+#include "trace.hpp"
+
+// https://github.com/libharu/libharu/wiki/Error-handling
+// `user_data` points to a flag that is set while the saved document is read
+static void error_handler(HPDF_STATUS error_no, HPDF_STATUS detail_no, void *user_data)
+{
+    // Reading up to the end of an in-memory document may be reported as an
+    // error; anywhere else, e.g. in a truncated font file, it is one
+    if (error_no == HPDF_STREAM_EOF && *(const bool *)user_data)
+        return;
+
+    fmt::print(stderr, "hpdf: error_no={:x}, detail_no={}\n",
+      (unsigned int) error_no, (int) detail_no);
+    throw std::exception (); /* throw exception on error */
+}
+
+namespace {
+
+// The whole document is built in memory by libHaru and written out at the end
+class HaruBackend final : public PdfBackend {
+public:
+    HaruBackend(const PdfSettings &settings, const FontFiles &fonts, const FontUsage *usage,
+                const PdfTarget &target);
+    ~HaruBackend() override;
+
+    PageId add_page() override {
+        pages.push_back(HPDF_AddPage(pdf));
+        return start_page();
+    }
+    PageId insert_page(PageId before) override {
+        pages.push_back(HPDF_InsertPage(pdf, pages[before]));
+        return start_page();
+    }
+    float page_width() const override { return width; }
+    float page_height() const override { return height; }
+
+    void set_font(Font font, float size) override {
+        HPDF_Page_SetFontAndSize(page, fonts[(int)font], size);
+    }
+    void set_text_leading(float leading) override { HPDF_Page_SetTextLeading(page, leading); }
+    void begin_text() override { HPDF_Page_BeginText(page); }
+    void end_text() override { HPDF_Page_EndText(page); }
+    void text_out(float x, float y, const std::string &text) override {
+        HPDF_Page_TextOut(page, x, y, text.c_str());
+    }
+    void move_text_pos(float dx, float dy) override { HPDF_Page_MoveTextPos(page, dx, dy); }
+    void show_text(const std::string &text) override { HPDF_Page_ShowText(page, text.c_str()); }
+    void show_text_next_line(const std::string &text) override {
+        HPDF_Page_ShowTextNextLine(page, text.c_str());
+    }
+
+    float text_width(const std::string &text) override {
+        return HPDF_Page_TextWidth(page, text.c_str());
+    }
+    int char_width(Font font, char32_t c) override {
+        // HPDF_UNICODE is 16 bits, so anything past the BMP would be
+        // measured as some unrelated character
+        if (c > 0xFFFF)
+            return 0;
+        return HPDF_Font_GetUnicodeWidth(fonts[(int)font], c);
+    }
+
+    void add_link(Rect rect, PageId dest) override;
+    void add_outline(const std::string &title, PageId page) override;
+
+    void finish() override;
+private:
+    HPDF_Doc pdf;
+    PdfTarget target;
+    bool utf8;
+
+    HPDF_Font fonts[3]; // By Font
+    HPDF_Outline outline_root = nullptr;
+
+    // Subset fonts, deleted with the document
+    std::vector<std::string> subset_files;
+
+    bool reading_stream = false; // For error_handler()
+
+    std::vector<HPDF_Page> pages; // By PageId
+    HPDF_Page page = nullptr;
+    float width = 0;
+    float height = 0;
+
+    PageId start_page() {
+        page = pages.back();
+        width = HPDF_Page_GetWidth(page);
+        height = HPDF_Page_GetHeight(page);
+        return pages.size() - 1;
+    }
+
+    // Calls f(const char *data, size_t size) for chunks of the saved stream
+    template<typename F>
+    void read_stream(F &&f);
+};
+
+HaruBackend::HaruBackend(const PdfSettings &settings, const FontFiles &files, const FontUsage *usage,
+                         const PdfTarget &target)
+    : target(target), utf8(settings.utf8)
+{
+    pdf = HPDF_New(error_handler, &reading_stream);
+
+    if (!pdf) {
+        fmt::print(stderr, "hpdf: cannot create document\n");
+        throw std::runtime_error("cannot create document");
+    }
+
+    try {
+        HPDF_SetCompressionMode(pdf, (settings.compress.text ? HPDF_COMP_TEXT : 0)
+                                   | (settings.compress.images ? HPDF_COMP_IMAGE : 0)
+                                   | (settings.compress.metadata ? HPDF_COMP_METADATA : 0));
+
+        if (settings.utf8) {
+            HPDF_UseUTFEncodings(pdf);
+            HPDF_SetCurrentEncoder(pdf, "UTF-8");
+        }
+
+        const char *encoding = settings.utf8 ? "UTF-8" : NULL;
+
+        // File to load for each font file, a subset if possible.
+        // libHaru loads a font only once, even if it's used
+        // for several roles, so the subset has to cover all of them.
+        std::map<std::string, std::string> load_paths;
+        if (usage && settings.utf8) {
+            std::map<std::string, CodePoints> used;
+            used[files.body].add(usage->body);
+            used[files.header].add(usage->header);
+            used[files.header_bold].add(usage->header_bold);
+
+            for (const auto &[file, code_points] : used) {
+                if (auto subset = subset_font(file, code_points)) {
+                    subset_files.push_back(*subset);
+                    load_paths[file] = *subset;
+                }
+            }
+        }
+
+        // Font files used for several roles are read only once, and
+        // end up in the PDF once
+        std::map<std::string, HPDF_Font> loaded;
+        auto load_font = [this, encoding, &load_paths, &loaded](const std::string &file) {
+            if (auto it = loaded.find(file); it != loaded.end())
+                return it->second;
+
+            trace::Span span("load font", file);
+            auto it = load_paths.find(file);
+            const std::string &path = it != load_paths.end() ? it->second : file;
+
+            const char *font_name = HPDF_LoadTTFontFromFile(pdf, path.c_str(), HPDF_TRUE);
+            return loaded[file] = HPDF_GetFont(pdf, font_name, encoding);
+        };
+
+        fonts[(int)Font::HeaderBold] = load_font(files.header_bold);
+        fonts[(int)Font::Header] = load_font(files.header);
+        fonts[(int)Font::Body] = load_font(files.body);
+    } catch (...) {
+        HPDF_Free(pdf);
+        for (const auto &file : subset_files)
+            unlink(file.c_str());
+        throw;
+    }
+}
+
+HaruBackend::~HaruBackend()
+{
+    HPDF_Free(pdf);
+
+    for (const auto &file : subset_files)
+        unlink(file.c_str());
+}
+
+template<typename F>
+void HaruBackend::read_stream(F &&f)
+{
+    char buf[1 << 16];
+
+    reading_stream = true;
+    // Never ask for more than is left, which libHaru treats as an error
+    size_t left = HPDF_GetStreamSize(pdf);
+    while (left > 0) {
+        HPDF_UINT32 size = std::min(left, sizeof(buf));
+        HPDF_ReadFromStream(pdf, (HPDF_BYTE*)buf, &size);
+        if (size == 0)
+            break;
+        f(buf, size);
+        left -= size;
+    }
+    reading_stream = false;
+}
+
+void HaruBackend::add_link(Rect rect, PageId dest)
+{
+    HPDF_Rect r = { rect.left, rect.bottom, rect.right, rect.top };
+    HPDF_Annotation link = HPDF_Page_CreateLinkAnnot(page, r, HPDF_Page_CreateDestination(pages[dest]));
+    HPDF_LinkAnnot_SetBorderStyle(link, 0, 0, 0);
+}
+
+void HaruBackend::add_outline(const std::string &title, PageId page)
+{
+    HPDF_Encoder encoder = utf8 ? HPDF_GetEncoder(pdf, "UTF-8") : NULL;
+
+    if (!outline_root) {
+        outline_root = HPDF_CreateOutline(pdf, NULL, "Songs", encoder);
+        HPDF_Outline_SetOpened(outline_root, HPDF_TRUE);
+        HPDF_SetPageMode(pdf, HPDF_PAGE_MODE_USE_OUTLINE);
+    }
+
+    HPDF_Outline outline = HPDF_CreateOutline(pdf, outline_root, title.c_str(), encoder);
+    HPDF_Outline_SetDestination(outline, HPDF_Page_CreateDestination(pages[page]));
+}
+
+void HaruBackend::finish()
+{
+    trace::Span span("save PDF", target.fn);
+
+    if (target.memory) {
+        HPDF_SaveToStream(pdf);
+
+        std::string &res = *target.memory;
+        res.reserve(HPDF_GetStreamSize(pdf));
+        read_stream([&res](const char *data, size_t size) {
+            res.append(data, size);
+        });
+
+        span.add_bytes(res.size());
+        return;
+    }
+
+    if (target.fn == "-") {
+        HPDF_SaveToStream(pdf);
+        read_stream([&span](const char *data, size_t size) {
+            for (size_t pos = 0; pos < size;) {
+                ssize_t w = write(STDOUT_FILENO, data + pos, size - pos);
+                if (w < 0 && errno == EINTR)
+                    continue;
+                if (w < 0) {
+                    std::perror("stdout");
+                    throw std::runtime_error("cannot write PDF");
+                }
+                pos += w;
+            }
+            span.add_bytes(size);
+        });
+        return;
+    }
+
+    HPDF_SaveToFile(pdf, target.fn.c_str());
+
+    if (struct stat st; trace::enabled() && stat(target.fn.c_str(), &st) == 0)
+        span.add_bytes(st.st_size);
+}
+
+}
+
+std::unique_ptr<PdfBackend> make_haru_backend(const PdfSettings &settings, const FontFiles &fonts,
+                                              const FontUsage *usage, const PdfTarget &target)
+{
+    return std::make_unique<HaruBackend>(settings, fonts, usage, target);
+}
@@ -49,6 +49,8 @@
 
         std::cout << "flag: " << flag << '\n';
         std::cout << "filename: " << filename << '\n';
+        for (auto arg : parser.positionals())
+            std::cout << "arg: " << arg << '\n';
     }
 
   Output:
@@ -60,6 +62,10 @@
       something
       flag: 1
       filename:
+    $ example --filename=a.out b.out
+      flag: 0
+      filename: a.out
+      arg: b.out
     $ example --help
       Usage: example [args]
         -f, --flag                     Set flag
@@ -130,8 +136,12 @@ public:
     void add(Flag f);
     void add_help(std::string_view usage);
     void parse(int argc, const char *const *argv);
+
+    // Arguments that are neither flags nor their values
+    const std::vector<std::string_view> &positionals() const { return m_positionals; }
 private:
     std::vector<Flag> flags;
+    std::vector<std::string_view> m_positionals;
 
     void print_help_page(std::string_view usage);
 };
@@ -235,6 +245,8 @@ void Parser::parse(int argc, const char *const *argv)
                     spec->action(std::string_view());
                 }
             }
+        } else {
+            m_positionals.push_back(arg);
         }
     }
 }
@@ -0,0 +1,143 @@
+#include <cerrno>
+
+#include <limits.h>
+#include <sys/uio.h>
+
+#include "layout.hpp"
+
+void Layout::clear()
+{
+    arena.clear();
+    m_lines.clear();
+    m_sections.clear();
+    section_begin = 0;
+    section_repeats = {};
+}
+
+void Layout::end_line(LayoutLine::Kind kind, size_t offset)
+{
+    m_lines.push_back({ kind, (uint32_t)offset, (uint32_t)(arena.size() - offset) });
+    arena.push_back('\n');
+}
+
+void Layout::add(LayoutLine::Kind kind, std::string_view text)
+{
+    size_t offset = arena.size();
+    arena.append(text);
+    end_line(kind, offset);
+}
+
+void Layout::add_lines(LayoutLine::Kind kind, std::string_view text)
+{
+    while (true) {
+        size_t nl = text.find('\n');
+        std::string_view line = text.substr(0, nl);
+        add(line.empty() ? LayoutLine::Kind::Blank : kind, line);
+
+        if (nl == std::string_view::npos)
+            break;
+        text.remove_prefix(nl + 1);
+    }
+}
+
+Layout::Range Layout::end_section(bool page_break)
+{
+    Range r = { section_begin, (uint32_t)m_lines.size() };
+    m_sections.push_back({ r, page_break, section_repeats });
+    section_begin = r.end;
+    section_repeats = {};
+    return r;
+}
+
+void Layout::repeat(Range r)
+{
+    // Not insert() from the vector itself, which the standard doesn't allow
+    m_lines.reserve(m_lines.size() + (r.end - r.begin));
+    for (uint32_t i = r.begin; i < r.end; i++)
+        m_lines.push_back(m_lines[i]);
+    section_repeats = r;
+}
+
+SectionText Layout::copy(Range r) const
+{
+    SectionText sec;
+    if (r.begin == r.end)
+        return sec;
+
+    // A section's own lines are contiguous in the arena
+    const LayoutLine &first = m_lines[r.begin], &last = m_lines[r.end - 1];
+    sec.text = arena.substr(first.offset, last.offset + last.size + 1 - first.offset);
+    for (const auto &line : lines(r))
+        sec.kinds.push_back(line.kind);
+    return sec;
+}
+
+void Layout::add(const SectionText &sec)
+{
+    size_t offset = arena.size();
+    arena.append(sec.text);
+
+    for (LayoutLine::Kind kind : sec.kinds) {
+        size_t size = arena.find('\n', offset) - offset;
+        m_lines.push_back({ kind, (uint32_t)offset, (uint32_t)size });
+        offset += size + 1;
+    }
+}
+
+bool Layout::write_to(int fd) const
+{
+    iovec iov[IOV_MAX];
+
+    size_t next = 0;
+    while (next < m_lines.size()) {
+        // Lines that follow each other in the arena are written as one
+        int n = 0;
+        for (; next < m_lines.size(); next++) {
+            const LayoutLine &line = m_lines[next];
+            const char *beg = arena.data() + line.offset;
+
+            if (n > 0 && (char*)iov[n - 1].iov_base + iov[n - 1].iov_len == beg) {
+                iov[n - 1].iov_len += line.size + 1;
+            } else if (n < IOV_MAX) {
+                iov[n++] = { (void*)beg, line.size + 1 };
+            } else {
+                break;
+            }
+        }
+
+        // Continue after partial writes
+        iovec *cur = iov;
+        while (n > 0) {
+            ssize_t w = writev(fd, cur, n);
+            if (w < 0) {
+                if (errno == EINTR)
+                    continue;
+                return false;
+            }
+
+            for (; n > 0 && (size_t)w >= cur->iov_len; cur++, n--)
+                w -= cur->iov_len;
+            if (n > 0) {
+                cur->iov_base = (char*)cur->iov_base + w;
+                cur->iov_len -= w;
+            }
+        }
+    }
+
+    return true;
+}
+
+void Layout::write_to(std::ostream &out) const
+{
+    std::string_view run;
+    for (const auto &line : m_lines) {
+        std::string_view s = std::string_view(arena).substr(line.offset, line.size + 1);
+        if (run.data() + run.size() == s.data()) {
+            run = std::string_view(run.data(), run.size() + s.size());
+        } else {
+            out << run;
+            run = s;
+        }
+    }
+    out << run;
+}
@@ -0,0 +1,96 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <iterator>
+#include <ostream>
+#include <span>
+#include <string>
+#include <string_view>
+#include <utility>
+#include <vector>
+
+#include <fmt/core.h>
+
+struct LayoutLine {
+    enum class Kind : uint8_t {
+        Blank,
+        Title,
+        Subtitle,
+        Name, // [Section name]
+        Chords,
+        Lyrics,
+        Text, // Section without chords
+    };
+
+    Kind kind;
+    uint32_t offset; // Into the text arena, where the line is followed by '\n'
+    uint32_t size;
+};
+
+// Lines of one section outside a Layout, e.g. for caching
+struct SectionText {
+    std::string text; // One '\n'-terminated line per kind
+    std::vector<LayoutLine::Kind> kinds;
+};
+
+// A formatted song, as one flat list of lines whose text is kept in
+// a single arena. Lines of a reproduced section refer to the text of
+// the original. Both text and PDF output are written from this.
+class Layout {
+public:
+    // Lines [begin, end)
+    struct Range {
+        uint32_t begin = 0;
+        uint32_t end = 0;
+    };
+
+    struct Section {
+        Range lines;
+        bool page_break;
+        // Of the section a reproduction repeats, empty for others
+        Range repeats;
+    };
+
+    void reserve(size_t bytes) { arena.reserve(bytes); }
+    void clear();
+
+    void add(LayoutLine::Kind kind, std::string_view text);
+    template<typename... T>
+    void print(LayoutLine::Kind kind, fmt::format_string<T...> fmt, T&&... args) {
+        size_t offset = arena.size();
+        fmt::format_to(std::back_inserter(arena), fmt, std::forward<T>(args)...);
+        end_line(kind, offset);
+    }
+    // Adds each line of `text` as a line of `kind`, empty ones as Blank
+    void add_lines(LayoutLine::Kind kind, std::string_view text);
+
+    // Lines added so far are the title, not part of any section
+    void end_header() { section_begin = m_lines.size(); }
+    // Ends the current section, returns its lines
+    Range end_section(bool page_break);
+    // Adds earlier lines again, without copying their text;
+    // the section they end up in is marked as repeating them
+    void repeat(Range r);
+
+    SectionText copy(Range r) const;
+    void add(const SectionText &sec);
+
+    std::span<const LayoutLine> lines() const { return m_lines; }
+    std::span<const LayoutLine> lines(Range r) const { return lines().subspan(r.begin, r.end - r.begin); }
+    std::span<const Section> sections() const { return m_sections; }
+    std::string_view text(const LayoutLine &line) const { return std::string_view(arena).substr(line.offset, line.size); }
+
+    // Writes all lines, with as few system calls as
+    // possible. Returns false on error.
+    bool write_to(int fd) const;
+    void write_to(std::ostream &out) const;
+private:
+    std::string arena;
+    std::vector<LayoutLine> m_lines;
+    std::vector<Section> m_sections;
+    uint32_t section_begin = 0; // First line of the current section
+    Range section_repeats; // Of the current section
+
+    void end_line(LayoutLine::Kind kind, size_t offset);
+};
@@ -1,4 +1,14 @@
+#include <algorithm>
+#include <atomic>
+#include <cstdio>
+#include <optional>
+#include <ranges>
+#include <string>
+#include <thread>
+#include <vector>
+
 #include <getopt.h>
+#include <unistd.h>
 
 #include <fmt/core.h>
 
@@ -6,6 +16,42 @@
 #include "jargs.hpp"
 
 #include "file.hpp"
+#include "options.hpp"
+#include "pdf.hpp"
+#include "pool.hpp"
+#include "server.hpp"
+#include "trace.hpp"
+#include "watch.hpp"
+
+// Flag setting an option from the table; Bool ones take no value
+static jargs::Flag option_flag(char c, std::string_view name, std::string_view help, std::optional<bool> &dst)
+{
+    return { c, name, help, [&dst]() { dst = true; } };
+}
+
+template<typename T>
+static jargs::Flag option_flag(char c, std::string_view name, std::string_view help, std::optional<T> &dst)
+{
+    return { c, name, help, [&dst, name](auto optarg) {
+        T value;
+        if (!opt::parse(optarg, value)) {
+            fmt::print(stderr, "Invalid {}: {}\n", name, optarg);
+            std::exit(1);
+        }
+        dst = std::move(value);
+    }};
+}
+
+// `output` if given, otherwise `fn` with a .pdf extension;
+// stdout for a song read from stdin
+static std::string pdf_name(std::string_view fn, const std::string &output)
+{
+    if (!output.empty())
+        return output;
+    if (fn == "-")
+        return "-";
+    return fmt::format("{}.pdf", fn.substr(0, fn.rfind('.')));
+}
 
 int main(int argc, char **argv)
 {
@@ -15,43 +61,211 @@ int main(int argc, char **argv)
     }
 
     bool pdf = false;
+    bool watch_file = false;
+    bool all_keys = false;
+    unsigned jobs = 1;
+    std::string songbook;
+    std::string output;
+    std::string serve_sock;
+    std::string connect_sock;
 
-    FileFormatter ff;
+    // Written when main returns
+    struct TraceOutput {
+        std::string fn;
+        bool stats = false;
+
+        ~TraceOutput() {
+            if (!fn.empty())
+                trace::write_chrome_trace(fn);
+            if (stats)
+                trace::print_stats();
+        }
+    } trace_output;
+
+    // Options from the command line, applied to every file
+    Options overrides;
 
     jargs::Parser parser;
     parser.add({'p', "pdf", "Generate PDF", [&pdf]() {
         pdf = true;
     }});
-    parser.add({'s', "size", "Specify font size", [&ff](auto optarg) {
-        ff.put_metadata(FF_SIZE, optarg);
+    parser.add({'o', "output", "Write the PDF to FILE instead of next to the input; - for stdout",
+            [&pdf, &output](auto optarg) {
+        pdf = true;
+        output = optarg;
+    }});
+#define X(member, key, type, def, short_name, help) \
+    if constexpr (sizeof(help) > 1) \
+        parser.add(option_flag(short_name, key, help, overrides.member));
+    ACCHORDING_OPTIONS(X)
+#undef X
+    parser.add({"all-keys", "Render the song in all 12 keys, one after another", [&all_keys]() {
+        all_keys = true;
+    }});
+    parser.add({'j', "jobs", "Process files on N threads", [&jobs](auto optarg) {
+        try {
+            jobs = std::max(std::stoi(std::string(optarg)), 1);
+        } catch (const std::exception &) {
+            fmt::print(stderr, "Invalid number of jobs: {}\n", optarg);
+            std::exit(1);
+        }
+    }});
+    parser.add({"songbook", "Write all files into one PDF with a table of contents", [&songbook](auto optarg) {
+        songbook = optarg;
+    }});
+    parser.add({"watch", "Render again whenever the file changes", [&watch_file]() {
+        watch_file = true;
     }});
-    parser.add({'b', "body-font", "Specify font \"name[:style]\" for PDF body", [&ff](auto optarg) {
-        ff.put_metadata(FF_BODY_FONT, optarg);
+    parser.add({"serve", "Serve render requests on a Unix socket, with -j workers", [&serve_sock](auto optarg) {
+        serve_sock = optarg;
     }});
-    parser.add({'t', "title-font",
-            "Specify font \"name\" for PDF header; should have 'Regular' and 'Bold' styles",
-            [&ff](auto optarg) {
-        ff.put_metadata(FF_TITLE_FONT, optarg);
+    parser.add({"connect", "Render the file on the server at a Unix socket", [&connect_sock](auto optarg) {
+        connect_sock = optarg;
     }});
-    parser.add({'u', "utf8", "Use UTF-8 in PDF generation", [&ff]() {
-        ff.put_metadata(FF_UTF8, "true");
+    parser.add({"trace", "Write Chrome trace events of all phases to a JSON file", [&trace_output](auto optarg) {
+        trace_output.fn = optarg;
+        trace::enable();
     }});
-    parser.add({"split", "Write both halves of PDF page", [&ff]() {
-        ff.put_metadata(FF_SPLIT, "true");
+    parser.add({"stats", "Print time spent per phase", [&trace_output]() {
+        trace_output.stats = true;
+        trace::enable();
     }});
-    parser.add_help("acchording [args] file");
+    parser.add_help("acchording [args] file...  (- for stdin)");
 
     parser.parse(argc, argv);
 
-    const char *fn = argv[argc-1];
-    ff.init(fn);
+    if (!serve_sock.empty())
+        return serve(serve_sock, overrides, jobs);
+
+    const auto &files = parser.positionals();
+    if (files.empty()) {
+        fmt::print(stderr, "Please specify a file.\n");
+        return 1;
+    }
+
+    if (!output.empty() && (files.size() != 1 || !songbook.empty())) {
+        fmt::print(stderr, "--output takes exactly one file; use --songbook for many\n");
+        return 1;
+    }
+
+    if (all_keys && (watch_file || !connect_sock.empty() || !songbook.empty())) {
+        fmt::print(stderr, "--all-keys can't be combined with --watch, --connect or --songbook\n");
+        return 1;
+    }
+
+    if (std::ranges::count(files, "-") > 0 && (files.size() != 1 || watch_file || !connect_sock.empty())) {
+        fmt::print(stderr, "- can only be read on its own, without --watch or --connect\n");
+        return 1;
+    }
+
+    // Every save would append another whole PDF to stdout
+    if (watch_file && output == "-") {
+        fmt::print(stderr, "--watch can't write the PDF to stdout\n");
+        return 1;
+    }
+
+    // A song piped in is written out as it arrives
+    if (files.front() == "-" && !pdf && !all_keys && songbook.empty()) {
+        FileFormatter ff;
+        ff.set_options(overrides);
+        return ff.stream(STDIN_FILENO, STDOUT_FILENO) ? 0 : 1;
+    }
+
+    if (watch_file || !connect_sock.empty()) {
+        if (files.size() != 1) {
+            fmt::print(stderr, "--{} takes exactly one file\n", watch_file ? "watch" : "connect");
+            return 1;
+        }
+
+        std::string fn(files.front());
+        std::string pdf_fn = pdf_name(fn, output);
+
+        if (watch_file)
+            return watch(fn, overrides, pdf, pdf_fn);
+        return serve_request(connect_sock, fn, overrides, pdf, pdf_fn);
+    }
+
+    if (!songbook.empty()) {
+        std::vector<FileFormatter> formatters(files.size());
+        std::vector<char> ok(files.size());
+
+        parallel_for(files.size(), jobs, [&](size_t i) {
+            formatters[i].set_options(overrides);
+            ok[i] = formatters[i].init(std::string(files[i]).c_str());
+        });
+
+        std::vector<FileFormatter *> songs;
+        for (size_t i = 0; i < files.size(); i++) {
+            if (ok[i])
+                songs.push_back(&formatters[i]);
+        }
+
+        if (!print_songbook_pdf(songs, songbook, jobs)) {
+            fmt::print(stderr, "{}: failed to write songbook\n", songbook);
+            return 1;
+        }
+        if (songs.size() < files.size()) {
+            fmt::print(stderr, "{} of {} files failed\n", files.size() - songs.size(), files.size());
+            return 1;
+        }
+        return 0;
+    }
+
+    // Text output of every file, written in order once all are done. A PDF
+    // is written as soon as its file is done, and nothing of it is kept.
+    std::vector<FileFormatter> formatters(pdf ? 0 : files.size());
+    std::vector<std::vector<SongVariant>> variants(all_keys && !pdf ? files.size() : 0);
+    std::vector<std::vector<const Layout *>> texts(pdf ? 0 : files.size());
+    std::atomic<size_t> failures = 0;
+
+    parallel_for(files.size(), jobs, [&](size_t i) {
+        std::string fn(files[i]);
 
-    if (!pdf) {
-        ff.print_formatted_txt();
-    } else {
-        std::string_view fn_base(fn);
-        fn_base = fn_base.substr(0, fn_base.rfind('.'));
+        FileFormatter own;
+        FileFormatter &ff = pdf ? own : formatters[i];
+        ff.set_options(overrides);
+        // Threads are better spent on files, if there are several
+        if (files.size() == 1)
+            ff.set_jobs(jobs);
 
-        ff.print_formatted_pdf(fmt::format("{}.pdf", fn_base));
+        if (!ff.init(fn.c_str())) {
+            failures++;
+            return;
+        }
+
+        if (all_keys) {
+            if (!pdf) {
+                variants[i] = ff.all_keys();
+                for (const auto &v : variants[i])
+                    texts[i].push_back(&v.layout);
+            } else if (!print_song_variants_pdf(ff.all_keys(), ff.pdf_settings(), pdf_name(fn, output))) {
+                fmt::print(stderr, "{}: failed to write PDF\n", fn);
+                failures++;
+            }
+        } else if (!pdf) {
+            texts[i].push_back(&ff.layout());
+        } else {
+            if (!ff.print_formatted_pdf(pdf_name(fn, output))) {
+                fmt::print(stderr, "{}: failed to write PDF\n", fn);
+                failures++;
+            }
+        }
+    });
+
+    std::fflush(stdout);
+
+    bool first = true;
+    for (const Layout *text : texts | std::views::join) {
+        if (!first && write(STDOUT_FILENO, "\n", 1) != 1)
+            break;
+        if (!text->write_to(STDOUT_FILENO))
+            break;
+        first = false;
+    }
+
+    if (failures > 0) {
+        if (files.size() > 1)
+            fmt::print(stderr, "{} of {} files failed\n", failures.load(), files.size());
+        return 1;
     }
 }
@@ -0,0 +1,739 @@
+#include <algorithm>
+#include <cctype>
+#include <cerrno>
+#include <cmath>
+#include <cstdio>
+#include <map>
+#include <stdexcept>
+#include <string>
+#include <string_view>
+#include <unordered_map>
+#include <vector>
+
+#include <fmt/core.h>
+
+#include <fcntl.h>
+#include <unistd.h>
+#include <zlib.h>
+
+#include "backend.hpp"
+#include "pdf.hpp"
+#include "trace.hpp"
+#include "utf8.hpp"
+
+// https://opensource.adobe.com/dc-acrobat-sdk-docs/pdfstandards/PDF32000_2008.pdf
+
+namespace {
+
+// A4, as libHaru's default
+constexpr float PAGE_WIDTH = 595.276f;
+constexpr float PAGE_HEIGHT = 841.89f;
+
+// Output is written in chunks of about this size, and at the end of every page
+constexpr size_t FLUSH_SIZE = 1 << 16;
+
+// Numbers with at most three decimals; PDF has no exponents
+void put_number(std::string &s, float x)
+{
+    long long v = std::llround(x * 1000);
+    if (v < 0) {
+        s += '-';
+        v = -v;
+    }
+    fmt::format_to(std::back_inserter(s), "{}", v / 1000);
+    if (int frac = v % 1000) {
+        char digits[4] = { char('0' + frac / 100), char('0' + frac / 10 % 10), char('0' + frac % 10), 0 };
+        std::string_view d(digits, frac % 10 ? 3 : frac % 100 ? 2 : 1);
+        s += '.';
+        s += d;
+    }
+}
+
+void put_rect(std::string &s, PdfBackend::Rect r)
+{
+    const float v[] = { r.left, r.bottom, r.right, r.top };
+    for (size_t i = 0; i < 4; i++) {
+        s += i ? ' ' : '[';
+        put_number(s, v[i]);
+    }
+    s += ']';
+}
+
+void put_hex16(std::string &s, uint16_t v)
+{
+    static constexpr char hex[] = "0123456789ABCDEF";
+    s += hex[v >> 12];
+    s += hex[v >> 8 & 0xF];
+    s += hex[v >> 4 & 0xF];
+    s += hex[v & 0xF];
+}
+
+// Writes the document front to back. Fonts go out first, each page when
+// it's done, and every object's offset is noted down for the cross-reference
+// table at the end. All that's kept until then is a few numbers per page
+// and the outline.
+class NativeBackend final : public PdfBackend {
+public:
+    NativeBackend(const PdfSettings &settings, const PdfTarget &target);
+    ~NativeBackend() override;
+
+    // False if one of the fonts can't be embedded
+    bool load_fonts(const FontFiles &files, const FontUsage &usage);
+
+    PageId add_page() override;
+    PageId insert_page(PageId before) override;
+    float page_width() const override { return PAGE_WIDTH; }
+    float page_height() const override { return PAGE_HEIGHT; }
+
+    void set_font(Font font, float size) override;
+    void set_text_leading(float leading) override;
+    void begin_text() override;
+    void end_text() override { content += "ET\n"; }
+    void text_out(float x, float y, const std::string &text) override;
+    void move_text_pos(float dx, float dy) override;
+    void show_text(const std::string &text) override;
+    void show_text_next_line(const std::string &text) override;
+
+    float text_width(const std::string &text) override;
+    int char_width(Font font, char32_t c) override;
+
+    bool has_forms() const override { return true; }
+    void begin_form() override;
+    FormId end_form(Rect bbox) override;
+    void draw_form(FormId form, float x, float y) override;
+
+    void add_link(Rect rect, PageId dest) override;
+    void add_outline(const std::string &title, PageId page) override;
+
+    void finish() override;
+private:
+    // A subset TrueType font, as a Type 0 font whose character codes
+    // are glyph numbers
+    struct EmbeddedFont {
+        uint32_t object;
+        float scale; // Font units to thousandths of the font size
+        std::vector<uint16_t> advances; // By glyph, in font units
+        uint16_t ascii[128] = {}; // Glyphs by code point
+        std::unordered_map<char32_t, uint16_t> other;
+
+        uint16_t glyph(char32_t c) const {
+            if (c < 128)
+                return ascii[c];
+            auto it = other.find(c);
+            return it != other.end() ? it->second : 0;
+        }
+    };
+
+    PdfTarget target;
+    int fd = -1; // Unless writing to memory
+    bool close_fd = false;
+    bool utf8;
+    bool deflate;
+
+    std::string buffer; // Not written to `fd` yet
+    std::string *out; // `buffer` or the target's string
+    uint64_t flushed = 0;
+    std::vector<uint64_t> offsets; // By object number; 0 is the free list head
+    bool finished = false;
+
+    std::vector<EmbeddedFont> fonts;
+    size_t roles[3] = {}; // Index into fonts by Font
+    std::string font_dict;
+    // Of all pages, written at the end with the forms
+    // they use; forms only have fonts
+    uint32_t resources = 0;
+    uint32_t form_resources = 0; // With the first form
+
+    std::vector<uint32_t> form_objects; // By FormId
+
+    uint32_t pages_object;
+    std::vector<uint32_t> page_objects; // By PageId
+    std::vector<PageId> order; // In the document
+
+    // Of the page being drawn
+    bool page_open = false;
+    std::string content;
+    std::vector<uint32_t> annots;
+    size_t font = 0;
+    float font_size = 0;
+    float line_x = 0, line_y = 0; // Start of the line in the text object
+
+    // What the page had drawn when a form was begun
+    struct PageState {
+        std::string content;
+        size_t font;
+        float font_size;
+        float line_x, line_y;
+    };
+    PageState page_state;
+
+    struct OutlineEntry {
+        std::string title;
+        PageId page;
+    };
+    std::vector<OutlineEntry> outline;
+
+    uint64_t offset() const { return flushed + out->size(); }
+    void put(std::string_view s) {
+        out->append(s);
+        if (out == &buffer && buffer.size() >= FLUSH_SIZE)
+            flush();
+    }
+    void flush();
+    // Opens the file and starts the document
+    void open_target();
+
+    uint32_t new_object() {
+        offsets.push_back(0);
+        return offsets.size() - 1;
+    }
+    void begin_object(uint32_t object) {
+        offsets[object] = offset();
+        put(fmt::format("{} 0 obj\n", object));
+    }
+    void write_object(uint32_t object, std::string_view dict) {
+        begin_object(object);
+        put(dict);
+        put("\nendobj\n");
+    }
+    // `dict` is added to the stream's dictionary
+    void write_stream(uint32_t object, std::string_view dict, std::string_view data);
+
+    void write_font(const FontSubset &subset, size_t index);
+    PageId start_page();
+    void finish_page();
+    // The glyphs of `text` as a hex string
+    void put_glyphs(const std::string &text);
+    // A PDF text string, in UTF-16 unless it's ASCII
+    std::string text_string(std::string_view text) const;
+};
+
+NativeBackend::NativeBackend(const PdfSettings &settings, const PdfTarget &target)
+    : target(target), utf8(settings.utf8), deflate(settings.compress.text)
+{
+}
+
+NativeBackend::~NativeBackend()
+{
+    if (close_fd) {
+        close(fd);
+        // Not a PDF without the end
+        if (!finished)
+            unlink(target.fn.c_str());
+    }
+}
+
+void NativeBackend::open_target()
+{
+    if (target.memory) {
+        out = target.memory;
+        out->clear();
+    } else if (target.fn == "-") {
+        out = &buffer;
+        fd = STDOUT_FILENO;
+    } else {
+        out = &buffer;
+        fd = open(target.fn.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0666);
+        if (fd < 0) {
+            std::perror(target.fn.c_str());
+            throw std::runtime_error("cannot write PDF");
+        }
+        close_fd = true;
+    }
+
+    new_object(); // Free
+    new_object(); // Catalog
+    pages_object = new_object();
+
+    // The comment's bytes tell transfer programs that the file is binary
+    put("%PDF-1.4\n%\xE2\xE3\xCF\xD3\n");
+}
+
+void NativeBackend::flush()
+{
+    if (fd < 0)
+        return;
+
+    for (size_t pos = 0; pos < buffer.size();) {
+        ssize_t w = write(fd, buffer.data() + pos, buffer.size() - pos);
+        if (w < 0 && errno == EINTR)
+            continue;
+        if (w < 0) {
+            std::perror(fd == STDOUT_FILENO ? "stdout" : target.fn.c_str());
+            throw std::runtime_error("cannot write PDF");
+        }
+        pos += w;
+    }
+    flushed += buffer.size();
+    buffer.clear();
+}
+
+void NativeBackend::write_stream(uint32_t object, std::string_view dict, std::string_view data)
+{
+    std::string packed;
+    if (deflate) {
+        uLongf size = compressBound(data.size());
+        packed.resize(size);
+        if (compress2((Bytef *)packed.data(), &size, (const Bytef *)data.data(), data.size(),
+                      Z_DEFAULT_COMPRESSION) != Z_OK)
+            throw std::runtime_error("cannot compress PDF stream");
+        packed.resize(size);
+        data = packed;
+    }
+
+    begin_object(object);
+    put(fmt::format("<< {}/Length {}{} >>\nstream\n", dict, data.size(),
+                    deflate ? " /Filter /FlateDecode" : ""));
+    put(data);
+    put("\nendstream\nendobj\n");
+}
+
+bool NativeBackend::load_fonts(const FontFiles &files, const FontUsage &usage)
+{
+    // Font files used for several roles are embedded once,
+    // with the glyphs of all of them
+    std::map<std::string, CodePoints> used;
+    used[files.body].add(usage.body);
+    used[files.header].add(usage.header);
+    used[files.header_bold].add(usage.header_bold);
+
+    // Latin-1 text isn't in the usage, which is counted in UTF-8
+    if (!utf8) {
+        std::string latin1;
+        for (char32_t c = 0xA0; c <= 0xFF; c++)
+            latin1 += { char(0xC0 | c >> 6), char(0x80 | (c & 0x3F)) };
+        for (auto &[file, code_points] : used)
+            code_points.add(latin1);
+    }
+
+    // Nothing is written before all fonts are known to work,
+    // so that libHaru can take over instead
+    std::vector<FontSubset> subsets;
+    std::map<std::string, size_t> index;
+    for (const auto &[file, code_points] : used) {
+        auto subset = make_font_subset(file, code_points);
+        if (!subset)
+            return false;
+        index[file] = subsets.size();
+        subsets.push_back(std::move(*subset));
+    }
+
+    open_target();
+    for (size_t i = 0; i < subsets.size(); i++) {
+        write_font(subsets[i], i);
+        subsets[i] = {};
+    }
+
+    roles[(int)Font::Body] = index[files.body];
+    roles[(int)Font::Header] = index[files.header];
+    roles[(int)Font::HeaderBold] = index[files.header_bold];
+
+    // Every page uses the same fonts
+    font_dict = "<<";
+    for (size_t i = 0; i < fonts.size(); i++)
+        font_dict += fmt::format(" /F{} {} 0 R", i + 1, fonts[i].object);
+    font_dict += " >>";
+    resources = new_object();
+
+    flush();
+    return true;
+}
+
+void NativeBackend::write_font(const FontSubset &subset, size_t index)
+{
+    EmbeddedFont font;
+    font.scale = 1000.0f / subset.units_per_em;
+    font.advances = subset.advances;
+
+    // Glyphs shown for the code points, and the other way
+    // around for copying text out of the PDF
+    std::vector<char32_t> unicode(subset.advances.size(), 0);
+    for (auto [c, g] : subset.glyphs) {
+        if (c < 128)
+            font.ascii[c] = g;
+        else
+            font.other.emplace(c, g);
+        if (g < unicode.size() && !unicode[g])
+            unicode[g] = c;
+    }
+
+    // Subset fonts are named with a tag of six capital letters in front
+    std::string name;
+    for (size_t i = 0, n = index; i < 6; i++, n /= 26)
+        name += char('A' + n % 26);
+    name += '+';
+    size_t tag_end = name.size();
+    for (char c : subset.name) {
+        if (std::isalnum((unsigned char)c) || c == '-')
+            name += c;
+    }
+    if (name.size() == tag_end)
+        name += fmt::format("Font{}", index + 1);
+
+    uint32_t file = new_object();
+    write_stream(file, fmt::format("/Length1 {} ", subset.data.size()), subset.data);
+
+    std::string cmap =
+        "/CIDInit /ProcSet findresource begin\n"
+        "12 dict begin\n"
+        "begincmap\n"
+        "/CIDSystemInfo << /Registry (Adobe) /Ordering (UCS) /Supplement 0 >> def\n"
+        "/CMapName /Adobe-Identity-UCS def\n"
+        "/CMapType 2 def\n"
+        "1 begincodespacerange\n<0000> <FFFF>\nendcodespacerange\n";
+    std::vector<std::pair<uint16_t, char32_t>> mapped;
+    for (size_t g = 0; g < unicode.size(); g++) {
+        if (unicode[g])
+            mapped.emplace_back(g, unicode[g]);
+    }
+    // At most 100 to a block
+    for (size_t i = 0; i < mapped.size(); i += 100) {
+        size_t n = std::min<size_t>(100, mapped.size() - i);
+        cmap += fmt::format("{} beginbfchar\n", n);
+        for (size_t k = i; k < i + n; k++) {
+            cmap += '<';
+            put_hex16(cmap, mapped[k].first);
+            cmap += "> <";
+            put_hex16(cmap, mapped[k].second);
+            cmap += ">\n";
+        }
+        cmap += "endbfchar\n";
+    }
+    cmap += "endcmap\n"
+            "CMapName currentdict /CMapResource defineresource pop\n"
+            "end\nend\n";
+    uint32_t to_unicode = new_object();
+    write_stream(to_unicode, "", cmap);
+
+    auto scaled = [&font](int v) { return (int)std::lround(v * font.scale); };
+
+    uint32_t descriptor = new_object();
+    write_object(descriptor, fmt::format(
+        "<< /Type /FontDescriptor /FontName /{} /Flags {} /FontBBox [{} {} {} {}] /ItalicAngle {}"
+        " /Ascent {} /Descent {} /CapHeight {} /StemV 80 /FontFile2 {} 0 R >>",
+        name, subset.fixed_pitch ? 5 : 4, // Symbolic, as the glyphs aren't in a standard encoding
+        scaled(subset.x_min), scaled(subset.y_min), scaled(subset.x_max), scaled(subset.y_max),
+        subset.italic_angle, scaled(subset.ascent), scaled(subset.descent), scaled(subset.cap_height),
+        file));
+
+    std::string widths = "[0 [";
+    for (size_t g = 0; g < font.advances.size(); g++)
+        widths += fmt::format("{} ", scaled(font.advances[g]));
+    widths += "]]";
+
+    uint32_t cid_font = new_object();
+    write_object(cid_font, fmt::format(
+        "<< /Type /Font /Subtype /CIDFontType2 /BaseFont /{}"
+        " /CIDSystemInfo << /Registry (Adobe) /Ordering (Identity) /Supplement 0 >>"
+        " /FontDescriptor {} 0 R /CIDToGIDMap /Identity /W {} >>",
+        name, descriptor, widths));
+
+    font.object = new_object();
+    write_object(font.object, fmt::format(
+        "<< /Type /Font /Subtype /Type0 /BaseFont /{} /Encoding /Identity-H"
+        " /DescendantFonts [{} 0 R] /ToUnicode {} 0 R >>",
+        name, cid_font, to_unicode));
+
+    fonts.push_back(std::move(font));
+}
+
+PdfBackend::PageId NativeBackend::start_page()
+{
+    if (page_open)
+        finish_page();
+    page_open = true;
+
+    page_objects.push_back(new_object());
+    return page_objects.size() - 1;
+}
+
+PdfBackend::PageId NativeBackend::add_page()
+{
+    PageId page = start_page();
+    order.push_back(page);
+    return page;
+}
+
+PdfBackend::PageId NativeBackend::insert_page(PageId before)
+{
+    PageId page = start_page();
+    order.insert(std::find(order.begin(), order.end(), before), page);
+    return page;
+}
+
+void NativeBackend::finish_page()
+{
+    uint32_t contents = new_object();
+    write_stream(contents, "", content);
+    content.clear();
+
+    std::string dict = fmt::format("<< /Type /Page /Parent {} 0 R /MediaBox [0 0 ", pages_object);
+    put_number(dict, PAGE_WIDTH);
+    dict += ' ';
+    put_number(dict, PAGE_HEIGHT);
+    dict += fmt::format("] /Resources {} 0 R /Contents {} 0 R", resources, contents);
+    if (!annots.empty()) {
+        dict += " /Annots [";
+        for (uint32_t a : annots)
+            dict += fmt::format(" {} 0 R", a);
+        dict += " ]";
+        annots.clear();
+    }
+    dict += " >>";
+    write_object(page_objects.back(), dict);
+
+    page_open = false;
+    flush();
+}
+
+void NativeBackend::set_font(Font role, float size)
+{
+    font = roles[(int)role];
+    font_size = size;
+    content += fmt::format("/F{} ", font + 1);
+    put_number(content, size);
+    content += " Tf\n";
+}
+
+void NativeBackend::set_text_leading(float leading)
+{
+    put_number(content, leading);
+    content += " TL\n";
+}
+
+void NativeBackend::begin_text()
+{
+    content += "BT\n";
+    line_x = line_y = 0;
+}
+
+void NativeBackend::text_out(float x, float y, const std::string &text)
+{
+    move_text_pos(x - line_x, y - line_y);
+    show_text(text);
+}
+
+void NativeBackend::move_text_pos(float dx, float dy)
+{
+    line_x += dx;
+    line_y += dy;
+    put_number(content, dx);
+    content += ' ';
+    put_number(content, dy);
+    content += " Td\n";
+}
+
+void NativeBackend::put_glyphs(const std::string &text)
+{
+    const EmbeddedFont &f = fonts[font];
+    content += '<';
+    for (size_t i = 0; i < text.size();)
+        put_hex16(content, f.glyph(utf8 ? utf8::decode(text, i) : (unsigned char)text[i++]));
+    content += '>';
+}
+
+void NativeBackend::show_text(const std::string &text)
+{
+    put_glyphs(text);
+    content += " Tj\n";
+}
+
+void NativeBackend::show_text_next_line(const std::string &text)
+{
+    put_glyphs(text);
+    content += " '\n";
+}
+
+float NativeBackend::text_width(const std::string &text)
+{
+    const EmbeddedFont &f = fonts[font];
+    float w = 0;
+    for (size_t i = 0; i < text.size();)
+        w += f.advances[f.glyph(utf8 ? utf8::decode(text, i) : (unsigned char)text[i++])];
+    return w * f.scale * font_size / 1000;
+}
+
+int NativeBackend::char_width(Font role, char32_t c)
+{
+    const EmbeddedFont &f = fonts[roles[(int)role]];
+    return std::lround(f.advances[f.glyph(c)] * f.scale);
+}
+
+void NativeBackend::begin_form()
+{
+    page_state = { std::move(content), font, font_size, line_x, line_y };
+    content.clear();
+}
+
+PdfBackend::FormId NativeBackend::end_form(Rect bbox)
+{
+    if (!form_resources) {
+        form_resources = new_object();
+        write_object(form_resources, fmt::format("<< /Font {} /ProcSet [/PDF /Text] >>", font_dict));
+    }
+
+    // Written out right away, like everything else
+    std::string dict = "/Type /XObject /Subtype /Form /BBox ";
+    put_rect(dict, bbox);
+    dict += fmt::format(" /Resources {} 0 R ", form_resources);
+
+    form_objects.push_back(new_object());
+    write_stream(form_objects.back(), dict, content);
+
+    content = std::move(page_state.content);
+    font = page_state.font;
+    font_size = page_state.font_size;
+    line_x = page_state.line_x;
+    line_y = page_state.line_y;
+    return form_objects.size() - 1;
+}
+
+void NativeBackend::draw_form(FormId form, float x, float y)
+{
+    content += "q 1 0 0 1 ";
+    put_number(content, x);
+    content += ' ';
+    put_number(content, y);
+    content += fmt::format(" cm /X{} Do Q\n", form + 1);
+}
+
+void NativeBackend::add_link(Rect rect, PageId dest)
+{
+    std::string dict = "<< /Type /Annot /Subtype /Link /Rect ";
+    put_rect(dict, rect);
+    dict += fmt::format(" /Border [0 0 0] /Dest [{} 0 R /Fit] >>", page_objects[dest]);
+
+    uint32_t annot = new_object();
+    write_object(annot, dict);
+    annots.push_back(annot);
+}
+
+void NativeBackend::add_outline(const std::string &title, PageId page)
+{
+    outline.push_back({ title, page });
+}
+
+std::string NativeBackend::text_string(std::string_view text) const
+{
+    std::u32string chars;
+    bool ascii = true;
+    for (size_t i = 0; i < text.size();) {
+        char32_t c = utf8 ? utf8::decode(text, i) : (unsigned char)text[i++];
+        ascii &= c >= 0x20 && c < 0x7F;
+        chars += c;
+    }
+
+    std::string res;
+    if (ascii) {
+        res += '(';
+        for (char32_t c : chars) {
+            if (c == '(' || c == ')' || c == '\\')
+                res += '\\';
+            res += (char)c;
+        }
+        res += ')';
+        return res;
+    }
+
+    res += "<FEFF";
+    for (char32_t c : chars) {
+        if (c >= 0x10000) {
+            c -= 0x10000;
+            put_hex16(res, 0xD800 | c >> 10);
+            put_hex16(res, 0xDC00 | (c & 0x3FF));
+        } else {
+            put_hex16(res, c);
+        }
+    }
+    res += '>';
+    return res;
+}
+
+void NativeBackend::finish()
+{
+    trace::Span span("save PDF", target.fn);
+
+    if (page_open)
+        finish_page();
+
+    std::string dict = fmt::format("<< /Font {}", font_dict);
+    if (!form_objects.empty()) {
+        dict += " /XObject <<";
+        for (size_t i = 0; i < form_objects.size(); i++)
+            dict += fmt::format(" /X{} {} 0 R", i + 1, form_objects[i]);
+        dict += " >>";
+    }
+    dict += " /ProcSet [/PDF /Text] >>";
+    write_object(resources, dict);
+
+    std::string kids;
+    for (PageId page : order)
+        kids += fmt::format(" {} 0 R", page_objects[page]);
+    write_object(pages_object, fmt::format("<< /Type /Pages /Kids [{} ] /Count {} >>", kids, order.size()));
+
+    // One open entry holding those of the songs, as libHaru's documents have
+    uint32_t outlines = 0;
+    if (!outline.empty()) {
+        outlines = new_object();
+        uint32_t songs = new_object();
+        uint32_t first = offsets.size();
+        uint32_t last = first + outline.size() - 1;
+
+        write_object(outlines, fmt::format("<< /Type /Outlines /First {0} 0 R /Last {0} 0 R /Count {1} >>",
+                                           songs, outline.size() + 1));
+        write_object(songs, fmt::format("<< /Title (Songs) /Parent {} 0 R /First {} 0 R /Last {} 0 R /Count {} >>",
+                                        outlines, first, last, outline.size()));
+        for (size_t i = 0; i < outline.size(); i++) {
+            uint32_t item = new_object();
+            std::string dict = fmt::format("<< /Title {} /Parent {} 0 R", text_string(outline[i].title), songs);
+            if (item > first)
+                dict += fmt::format(" /Prev {} 0 R", item - 1);
+            if (item < last)
+                dict += fmt::format(" /Next {} 0 R", item + 1);
+            dict += fmt::format(" /Dest [{} 0 R /Fit] >>", page_objects[outline[i].page]);
+            write_object(item, dict);
+        }
+    }
+
+    const uint32_t catalog = 1; // Numbered first, written last
+    write_object(catalog, outlines
+        ? fmt::format("<< /Type /Catalog /Pages {} 0 R /Outlines {} 0 R /PageMode /UseOutlines >>",
+                      pages_object, outlines)
+        : fmt::format("<< /Type /Catalog /Pages {} 0 R >>", pages_object));
+
+    uint32_t info = new_object();
+    write_object(info, "<< /Producer (acchording) >>");
+
+    // Entries are 20 bytes each, with the two-character line end
+    uint64_t xref = offset();
+    std::string table = fmt::format("xref\n0 {}\n0000000000 65535 f \n", offsets.size());
+    for (size_t i = 1; i < offsets.size(); i++)
+        table += fmt::format("{:010} 00000 n \n", offsets[i]);
+    table += fmt::format("trailer\n<< /Size {} /Root {} 0 R /Info {} 0 R >>\nstartxref\n{}\n%%EOF\n",
+                         offsets.size(), catalog, info, xref);
+    put(table);
+    flush();
+
+    if (close_fd) {
+        int res = close(fd);
+        close_fd = false;
+        if (res != 0) {
+            std::perror(target.fn.c_str());
+            unlink(target.fn.c_str());
+            throw std::runtime_error("cannot write PDF");
+        }
+    }
+    finished = true;
+    span.add_bytes(offset());
+}
+
+}
+
+std::unique_ptr<PdfBackend> make_native_backend(const PdfSettings &settings, const FontFiles &fonts,
+                                                const FontUsage &usage, const PdfTarget &target)
+{
+    auto backend = std::make_unique<NativeBackend>(settings, target);
+    if (!backend->load_fonts(fonts, usage))
+        return nullptr;
+    return backend;
+}
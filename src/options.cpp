@@ -0,0 +1,219 @@
+#include <algorithm>
+#include <array>
+#include <cctype>
+#include <charconv>
+#include <type_traits>
+
+#include <fmt/core.h>
+
+#include "options.hpp"
+
+namespace {
+
+constexpr std::array option_keys = {
+#define X(member, key, ...) std::string_view(key),
+    ACCHORDING_OPTIONS(X)
+#undef X
+};
+
+// Keys are found with a perfect hash: a seed for FNV-1a, found at compile
+// time, under which no two keys share a slot. Lookup is one hash and one
+// comparison.
+constexpr size_t SLOTS = 32;
+static_assert(SLOTS >= 2 * option_keys.size(), "Too many options for the hash table");
+
+constexpr uint32_t hash(std::string_view key, uint32_t seed)
+{
+    uint32_t h = seed;
+    for (char c : key)
+        h = (h ^ (uint8_t)c) * 16777619u;
+    return h;
+}
+
+constexpr uint32_t find_seed()
+{
+    for (uint32_t seed = 2166136261u; seed < 2166136261u + 10000; seed++) {
+        std::array<bool, SLOTS> used = {};
+        bool collision = false;
+        for (std::string_view key : option_keys) {
+            bool &slot = used[hash(key, seed) % SLOTS];
+            collision |= slot;
+            slot = true;
+        }
+        if (!collision)
+            return seed;
+    }
+    return 0;
+}
+
+constexpr uint32_t seed = find_seed();
+static_assert(seed != 0, "No perfect hash for the option keys");
+
+// Index into option_keys of each slot, -1 if empty
+constexpr auto slots = [] {
+    std::array<int8_t, SLOTS> res;
+    res.fill(-1);
+    for (size_t i = 0; i < option_keys.size(); i++)
+        res[hash(option_keys[i], seed) % SLOTS] = i;
+    return res;
+}();
+
+}
+
+namespace opt {
+
+bool parse(std::string_view value, Text &out)
+{
+    out = value;
+    return true;
+}
+
+bool parse(std::string_view value, Int &out)
+{
+    // Allow "+2" and trailing whitespace, e.g. "\r"
+    if (value.starts_with('+'))
+        value.remove_prefix(1);
+    while (!value.empty() && std::isspace((unsigned char)value.back()))
+        value.remove_suffix(1);
+
+    auto [end, ec] = std::from_chars(value.data(), value.data() + value.size(), out);
+    return ec == std::errc() && end == value.data() + value.size();
+}
+
+bool parse(std::string_view value, Bool &out)
+{
+    out = value == "true" || value == "1";
+    return true;
+}
+
+bool parse(std::string_view value, Compression &out)
+{
+    out = {};
+    if (value == "all") {
+        out = Compression::all();
+        return true;
+    }
+    if (value == "none")
+        return true;
+
+    while (true) {
+        size_t comma = value.find(',');
+        std::string_view part = value.substr(0, comma);
+        if (part == "text")
+            out.text = true;
+        else if (part == "images")
+            out.images = true;
+        else if (part == "metadata")
+            out.metadata = true;
+        else
+            return false;
+
+        if (comma == std::string_view::npos)
+            return true;
+        value.remove_prefix(comma + 1);
+    }
+}
+
+std::string to_string(const Text &value) { return value; }
+std::string to_string(Int value) { return fmt::format("{}", value); }
+std::string to_string(Bool value) { return value ? "true" : "false"; }
+
+std::string to_string(const Compression &value)
+{
+    if (value == Compression::all())
+        return "all";
+
+    std::string res;
+    for (auto [on, name] : { std::pair{ value.text, "text" }, { value.images, "images" }, { value.metadata, "metadata" } }) {
+        if (!on)
+            continue;
+        if (!res.empty())
+            res += ',';
+        res += name;
+    }
+    return res.empty() ? "none" : res;
+}
+
+}
+
+std::optional<OptionId> Options::find(std::string_view key)
+{
+    int8_t i = slots[hash(key, seed) % SLOTS];
+    if (i < 0 || option_keys[i] != key)
+        return std::nullopt;
+    return (OptionId)i;
+}
+
+// Defaults come from config.hpp, where numbers used to be strings such
+// as "11"; copies of the old config.def.hpp still have those
+template<typename T, typename D>
+static constexpr bool valid_default(const D &def)
+{
+    if constexpr (std::is_constructible_v<std::optional<T>, const D &>) {
+        return true;
+    } else if constexpr (std::is_same_v<T, opt::Int> && std::is_convertible_v<const D &, std::string_view>) {
+        std::string_view s(def);
+        if (s.starts_with('+') || s.starts_with('-'))
+            s.remove_prefix(1);
+        return !s.empty() && std::ranges::all_of(s, [](char c) { return c >= '0' && c <= '9'; });
+    } else {
+        return false;
+    }
+}
+
+template<typename T, typename D>
+static std::optional<T> default_value(const D &def)
+{
+    if constexpr (std::is_constructible_v<std::optional<T>, const D &>) {
+        return def;
+    } else {
+        T res{};
+        opt::parse(std::string_view(def), res);
+        return res;
+    }
+}
+
+Options Options::defaults()
+{
+    Options res;
+#define X(member, key, type, def, ...) \
+    static_assert(valid_default<opt::type>(def), "Invalid default for \"" key "\" in config.hpp"); \
+    res.member = default_value<opt::type>(def);
+    ACCHORDING_OPTIONS(X)
+#undef X
+    return res;
+}
+
+bool Options::is_set(OptionId id) const
+{
+    switch (id) {
+#define X(member, ...) case OptionId::member: return member.has_value();
+    ACCHORDING_OPTIONS(X)
+#undef X
+    }
+    return false;
+}
+
+bool Options::set(OptionId id, std::string_view value)
+{
+    switch (id) {
+#define X(member, key, type, ...) \
+    case OptionId::member: { \
+        opt::type v{}; \
+        if (!opt::parse(value, v)) \
+            return false; \
+        member = std::move(v); \
+        return true; \
+    }
+    ACCHORDING_OPTIONS(X)
+#undef X
+    }
+    return false;
+}
+
+void Options::fill(const Options &other)
+{
+#define X(member, ...) if (!member) member = other.member;
+    ACCHORDING_OPTIONS(X)
+#undef X
+}
@@ -0,0 +1,96 @@
+#pragma once
+
+#include <cstdint>
+#include <optional>
+#include <string>
+#include <string_view>
+
+#include "config.hpp"
+
+// Every option of the song header, in one place:
+//   X(member, key, type, default, short flag, flag help)
+// Options with a help text can also be set on the command line, with
+// `--key`; Bool flags take no value. Bool values are true for "true"
+// and "1", everything else is false. Compression is "all", "none" or a
+// list of "text", "images" and "metadata", separated by commas.
+#define ACCHORDING_OPTIONS(X) \
+    /* Data printed out */ \
+    X(title,      "title",      Text, std::nullopt, 0, "") \
+    X(author,     "author",     Text, std::nullopt, 0, "") \
+    X(capo,       "capo",       Text, std::nullopt, 0, "") \
+    X(key,        "key",        Text, std::nullopt, 0, "") \
+    X(tuning,     "tuning",     Text, std::nullopt, 0, "") \
+    /* Options for PDF generation */ \
+    X(size,       "size",       Int,  ACCHORDING_BODY_FONT_SIZE, 's', "Specify font size") \
+    X(body_font,  "body-font",  Text, ACCHORDING_BODY_FONT, 'b', \
+      "Specify font \"name[:style]\" for PDF body") \
+    X(title_font, "title-font", Text, ACCHORDING_HEADER_FONT, 't', \
+      "Specify font \"name\" for PDF header; should have 'Regular' and 'Bold' styles") \
+    X(utf8,       "utf8",       Bool, false, 'u', "Use UTF-8 in PDF generation") \
+    X(split,      "split",      Bool, false, 0, "Write both halves of PDF page") \
+    X(compress,   "compress",   Compression, opt::Compression::all(), 0, \
+      "Compress PDF streams: all (default), none, or any of text,images,metadata") \
+    X(native_pdf, "native-pdf", Bool, false, 0, \
+      "Write PDFs with the built-in streaming writer instead of libHaru") \
+    X(transpose,  "transpose",  Int,  0, 0, "Transpose chords by N semitones")
+
+namespace opt {
+
+using Text = std::string;
+using Int = int;
+using Bool = bool;
+
+// Which streams of a PDF are compressed
+struct Compression {
+    bool text = false; // Page content and fonts
+    bool images = false;
+    bool metadata = false;
+
+    static constexpr Compression all() { return { true, true, true }; }
+    bool operator==(const Compression &) const = default;
+};
+
+// Parse option values; false if `value` isn't one
+bool parse(std::string_view value, Text &out);
+bool parse(std::string_view value, Int &out);
+bool parse(std::string_view value, Bool &out);
+bool parse(std::string_view value, Compression &out);
+
+std::string to_string(const Text &value);
+std::string to_string(Int value);
+std::string to_string(Bool value);
+std::string to_string(const Compression &value);
+
+}
+
+enum class OptionId : uint8_t {
+#define X(member, ...) member,
+    ACCHORDING_OPTIONS(X)
+#undef X
+};
+
+// Values of the header options, each unset until given
+struct Options {
+#define X(member, key, type, ...) std::optional<opt::type> member;
+    ACCHORDING_OPTIONS(X)
+#undef X
+
+    // The option named `key`, if there is one
+    static std::optional<OptionId> find(std::string_view key);
+
+    static Options defaults();
+
+    bool is_set(OptionId id) const;
+    // Returns false, leaving the option as it was, if `value` is invalid
+    bool set(OptionId id, std::string_view value);
+    // Sets the options that are unset here but set in `other`
+    void fill(const Options &other);
+
+    // Calls f(key, value) for every option that is set
+    template<typename F>
+    void for_each(F &&f) const {
+#define X(member, key, ...) if (member) f(std::string_view(key), opt::to_string(*member));
+        ACCHORDING_OPTIONS(X)
+#undef X
+    }
+};
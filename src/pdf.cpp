@@ -0,0 +1,500 @@
+#include <algorithm>
+#include <map>
+#include <mutex>
+#include <string>
+
+#include <fmt/core.h>
+
+#include "font.hpp"
+#include "pdf.hpp"
+#include "pool.hpp"
+#include "trace.hpp"
+#include "utf8.hpp"
+
+// Bytes of text that a form has to save, drawn from it
+// instead of line by line, to be worth its own objects
+static constexpr size_t FORM_MIN_SAVING = 512;
+
+FontFiles FontFiles::resolve(const PdfSettings &settings)
+{
+    FontFiles files;
+
+    // fontconfig is initialized and torn down globally,
+    // so only one thread may use it at a time
+    static std::mutex fontconfig_mutex;
+    std::lock_guard lock(fontconfig_mutex);
+
+    FontMatcher fm;
+
+    // These shouldn't fail, as fontconfig will just default
+    // back to another font if it can't find a match
+    files.body = fm.match_name(settings.body_font);
+    files.header = fm.match_name(fmt::format("{}:Regular", settings.title_font));
+    files.header_bold = fm.match_name(fmt::format("{}:Bold", settings.title_font));
+
+    // Not on stdout, which may be the PDF itself
+    fmt::print(stderr, "Body font: {}\n", files.body);
+    fmt::print(stderr, "Header font: {}\n", files.header);
+    fmt::print(stderr, "Header font (bold): {}\n", files.header_bold);
+
+    return files;
+}
+
+void FontUsage::add_song(const std::string &title, const std::string &subtitle, const Layout &layout)
+{
+    header_bold.add(title);
+    header.add(subtitle);
+    // For GlyphAdvances::monospace(), which a subset without them would fool
+    body.add("iM");
+    for (const auto &sec : layout.sections()) {
+        for (const auto &line : layout.lines(sec.lines))
+            body.add(layout.text(line));
+    }
+}
+
+GlyphAdvances::GlyphAdvances(PdfBackend &backend, PdfBackend::Font font, float size,
+                             const CodePoints *usage)
+    : backend(&backend), font(font), scale(size / 1000)
+{
+    // Where the whole BMP would be needed, the table stops at what's in use
+    constexpr char32_t BMP_END = 0x10000;
+
+    std::vector<char32_t> used = usage ? usage->sorted() : std::vector<char32_t>();
+    auto last = std::lower_bound(used.begin(), used.end(), BMP_END);
+    table.assign(std::max<char32_t>(last == used.begin() ? 0 : last[-1] + 1, 128), -1);
+
+    for (char32_t c = 0; c < 128; c++)
+        table[c] = backend.char_width(font, c) * scale;
+    for (auto it = used.begin(); it != last; ++it)
+        table[*it] = backend.char_width(font, *it) * scale;
+}
+
+float GlyphAdvances::look_up(char32_t c)
+{
+    float w = backend->char_width(font, c) * scale;
+    if (c < table.size())
+        table[c] = w;
+    else if (c < 0x10000)
+        table.resize(c + 1, -1), table[c] = w;
+    return w;
+}
+
+float GlyphAdvances::width(std::string_view text, bool utf8)
+{
+    float w = 0;
+    for (size_t i = 0; i < text.size();)
+        w += (*this)[utf8 ? utf8::decode(text, i) : (unsigned char)text[i++]];
+    return w;
+}
+
+PdfDocument::PdfDocument(const PdfSettings &settings, const PdfTarget &target,
+                         const FontFiles *fonts, const FontUsage *usage)
+    : settings(settings)
+{
+    FontFiles resolved;
+    if (!fonts) {
+        resolved = FontFiles::resolve(settings);
+        fonts = &resolved;
+    }
+
+    if (settings.native && usage) {
+        backend = make_native_backend(settings, *fonts, *usage, target);
+        if (!backend)
+            fmt::print(stderr, "Warning: Fonts can't be embedded by the native PDF writer, using libHaru\n");
+    }
+    if (!backend)
+        backend = make_haru_backend(settings, *fonts, usage, target);
+
+    body_advances = GlyphAdvances(*backend, PdfBackend::Font::Body, settings.size,
+                                  usage ? &usage->body : nullptr);
+    proportional = !body_advances.monospace();
+}
+
+PdfDocument::PageId PdfDocument::new_page()
+{
+    // Ends the previous page's span
+    page_span.emplace("emit page");
+
+    PageId page = backend->add_page();
+    pages++;
+
+    page_height = backend->page_height();
+    page_width = backend->page_width();
+
+    return page;
+}
+
+PdfDocument::PageId PdfDocument::add_song(const std::string &title, const std::string &subtitle,
+                                          const Layout &layout)
+{
+    PageId first_page = new_page();
+
+    float height = page_height;
+
+    int pos = height - 50;
+
+    const int left_margin = 50;
+
+    // Title
+    backend->set_font(PdfBackend::Font::HeaderBold, 18);
+
+    backend->begin_text();
+    backend->text_out(left_margin, pos, title);
+    backend->end_text();
+
+    // Sub header
+    backend->set_font(PdfBackend::Font::Header, 12);
+
+    backend->begin_text();
+    backend->text_out(left_margin, (pos -= 20), subtitle);
+    backend->end_text();
+
+    // Pagination: the body is cut into columns of as many lines as fit
+    // above the bottom margin. A column starts on a new page, or on the
+    // right half of the page with --split.
+    struct Column {
+        uint32_t begin, end; // Lines
+        float x;
+        int top; // Of the first line
+        bool new_page;
+    };
+
+    const int leading = settings.size + 2;
+    const int bottom = 50;
+    auto capacity = [&](int top) -> uint32_t {
+        // At least one line, even if it doesn't fit
+        return leading > 0 ? std::max((top - bottom) / leading + 1, 1) : UINT32_MAX;
+    };
+
+    const float split_page_right_x = page_width / 2;
+    bool split_page_right = false;
+    int starting_pos = pos - 10;
+
+    uint32_t body = layout.sections().empty() ? 0 : layout.sections().front().lines.begin;
+    std::vector<Column> columns = { { body, body, left_margin, starting_pos, false } };
+    uint32_t fits = capacity(starting_pos);
+
+    auto next_column = [&]() {
+        uint32_t at = columns.back().end;
+        if (settings.split && !split_page_right) {
+            columns.push_back({ at, at, split_page_right_x, starting_pos, false });
+        } else {
+            columns.push_back({ at, at, left_margin, int(height - 30), true });
+        }
+        fits = capacity(columns.back().top);
+
+        if (settings.split) {
+            split_page_right = !split_page_right;
+            starting_pos = height - 30; // if not first page
+        }
+    };
+
+    for (const auto &sec : layout.sections()) {
+        for (uint32_t i = sec.lines.begin; i < sec.lines.end; i++) {
+            if (columns.back().end - columns.back().begin == fits)
+                next_column();
+            columns.back().end++;
+        }
+
+        if (sec.page_break)
+            next_column();
+    }
+
+    // Backends take whole strings
+    std::string text;
+
+    auto all_lines = layout.lines();
+
+    // Sections that repeat others, and those they repeat, are drawn from
+    // one form each where they fit into a column, instead of line by line
+    struct Shared {
+        Layout::Range lines;
+        uint32_t source; // First line of the original
+    };
+    std::vector<Shared> shared;
+    if (backend->has_forms()) {
+        std::vector<uint32_t> sources;
+        for (const auto &sec : layout.sections()) {
+            if (sec.repeats.begin != sec.repeats.end)
+                sources.push_back(sec.repeats.begin);
+        }
+        std::sort(sources.begin(), sources.end());
+
+        struct Uses {
+            size_t count = 0;
+            size_t last_page = SIZE_MAX;
+        };
+        std::map<uint32_t, Uses> uses;
+
+        auto col = columns.begin();
+        size_t page = 0;
+        for (const auto &sec : layout.sections()) {
+            uint32_t source = sec.repeats.begin != sec.repeats.end ? sec.repeats.begin : sec.lines.begin;
+            if (sec.lines.begin == sec.lines.end || !std::binary_search(sources.begin(), sources.end(), source))
+                continue;
+
+            while (col->end <= sec.lines.begin)
+                page += (++col)->new_page;
+            if (sec.lines.end <= col->end) {
+                shared.push_back({ sec.lines, source });
+
+                // Compression finds repeats within a page by itself
+                Uses &u = uses[source];
+                if (!settings.compress.text || u.last_page != page)
+                    u.count++;
+                u.last_page = page;
+            }
+        }
+
+        // A form only pays off with enough text drawn from it again
+        std::erase_if(shared, [&](const Shared &s) {
+            size_t bytes = 0;
+            for (const auto &line : all_lines.subspan(s.source, s.lines.end - s.lines.begin))
+                bytes += line.size;
+            return bytes * (uses[s.source].count - 1) < FORM_MIN_SAVING;
+        });
+    }
+    auto next_shared = shared.begin();
+
+    // Made when first drawn; the first line is one leading below the origin
+    std::map<uint32_t, PdfBackend::FormId> forms;
+    auto form = [&](uint32_t source, uint32_t n) {
+        auto [it, added] = forms.try_emplace(source);
+        if (added) {
+            auto lines = all_lines.subspan(source, n);
+            backend->begin_form();
+            backend->set_font(PdfBackend::Font::Body, settings.size);
+            backend->set_text_leading(leading);
+            backend->begin_text();
+            for (size_t i = 0; i < n; i++)
+                show_line(layout, lines, i, leading, text);
+            backend->end_text();
+            it->second = backend->end_form({ 0, -(float)(n * leading + settings.size),
+                                             page_width, (float)settings.size });
+        }
+        return it->second;
+    };
+
+    // Each column is one text object, but for the forms in it;
+    // lines after the first only need the next-line operator
+    for (const auto &col : columns) {
+        if (col.new_page)
+            new_page();
+        if (col.new_page || &col == &columns.front()) {
+            backend->set_font(PdfBackend::Font::Body, settings.size);
+            backend->set_text_leading(leading);
+        }
+
+        float y = col.top + leading; // Of the line before the next
+        bool in_text = false;
+        for (uint32_t i = col.begin; i < col.end; i++) {
+            while (next_shared != shared.end() && next_shared->lines.begin < i)
+                ++next_shared;
+            if (next_shared != shared.end() && next_shared->lines.begin == i) {
+                uint32_t n = next_shared->lines.end - i;
+                if (in_text)
+                    backend->end_text();
+                in_text = false;
+                backend->draw_form(form(next_shared->source, n), col.x, y);
+                y -= n * leading;
+                i += n - 1;
+                continue;
+            }
+
+            if (!in_text) {
+                backend->begin_text();
+                backend->move_text_pos(col.x, y);
+                in_text = true;
+            }
+            show_line(layout, all_lines, i, leading, text);
+            y -= leading;
+        }
+        if (in_text)
+            backend->end_text();
+    }
+    page_span.reset();
+
+    return first_page;
+}
+
+void PdfDocument::show_line(const Layout &layout, std::span<const LayoutLine> lines, size_t i,
+                            float leading, std::string &buf)
+{
+    const LayoutLine &line = lines[i];
+    // Chord columns only fit the lyrics in a monospace font
+    if (proportional && line.kind == LayoutLine::Kind::Chords && i + 1 < lines.size()
+        && (lines[i + 1].kind == LayoutLine::Kind::Lyrics || lines[i + 1].kind == LayoutLine::Kind::Text)) {
+        show_chords(layout.text(line), layout.text(lines[i + 1]), leading, buf);
+        return;
+    }
+    buf.assign(layout.text(line));
+    backend->show_text_next_line(buf);
+}
+
+void PdfDocument::show_chords(std::string_view chords, std::string_view lyrics, float leading,
+                              std::string &buf)
+{
+    const bool utf8 = settings.utf8;
+    const float space = body_advances[' '];
+
+    float x = 0; // Of the text position
+    float end = -space; // Of the chord before
+
+    // Walked along with the chords, which come in column order
+    size_t lyrics_pos = 0, lyrics_col = 0;
+    float lyrics_x = 0;
+
+    backend->move_text_pos(0, -leading);
+    for (size_t pos = chords.find_first_not_of(' '); pos != std::string_view::npos;) {
+        size_t chord_end = std::min(chords.find(' ', pos), chords.size());
+        std::string_view chord = chords.substr(pos, chord_end - pos);
+
+        // Chord lines are ASCII but for a few symbols, bytes are columns
+        while (lyrics_col < pos && lyrics_pos < lyrics.size()) {
+            char32_t c = utf8 ? utf8::decode(lyrics, lyrics_pos) : (unsigned char)lyrics[lyrics_pos++];
+            lyrics_x += body_advances[c];
+            lyrics_col += utf8 ? utf8::width(c) : 1;
+        }
+        float at = lyrics_x + (pos > lyrics_col ? (pos - lyrics_col) * space : 0);
+        // Keep chords apart where the lyrics are narrower than them
+        at = std::max(at, end + space);
+
+        buf.assign(chord);
+        backend->move_text_pos(at - x, 0);
+        backend->show_text(buf);
+        x = at;
+        end = at + body_advances.width(chord, utf8);
+
+        pos = chords.find_first_not_of(' ', chord_end);
+    }
+    backend->move_text_pos(-x, 0);
+}
+
+void PdfDocument::add_toc(PageId first_page, const std::vector<TocEntry> &entries)
+{
+    const int left_margin = 50;
+    const int right_margin = 50;
+    const int line_height = 16;
+    const int top = page_height - 80;
+
+    const size_t per_page = (top - 50) / line_height + 1;
+    const size_t n_pages = std::max<size_t>(1, (entries.size() + per_page - 1) / per_page);
+
+    for (size_t i = 0; i < n_pages; i++) {
+        backend->insert_page(first_page);
+        pages++;
+
+        if (i == 0) {
+            backend->set_font(PdfBackend::Font::HeaderBold, 18);
+
+            backend->begin_text();
+            backend->text_out(left_margin, page_height - 50, "Contents");
+            backend->end_text();
+        }
+
+        backend->set_font(PdfBackend::Font::Header, 12);
+
+        int pos = top;
+        for (size_t j = i * per_page; j < std::min(entries.size(), (i + 1) * per_page); j++) {
+            const TocEntry &entry = entries[j];
+
+            std::string number = std::to_string(entry.page_number + n_pages);
+            float number_x = page_width - right_margin - backend->text_width(number);
+
+            backend->begin_text();
+            backend->text_out(left_margin, pos, entry.title);
+            backend->text_out(number_x, pos, number);
+            backend->end_text();
+
+            backend->add_link({ (float)left_margin, (float)(pos - 4),
+                                page_width - right_margin, (float)(pos + 12) }, entry.page);
+
+            pos -= line_height;
+        }
+    }
+}
+
+void PdfDocument::add_outline(const std::string &title, PageId page)
+{
+    backend->add_outline(title, page);
+}
+
+void PdfDocument::finish()
+{
+    backend->finish();
+}
+
+bool print_songbook_pdf(std::span<FileFormatter *const> songs, const std::string &fn, unsigned jobs)
+{
+    if (songs.empty()) {
+        fmt::print(stderr, "Songbook is empty\n");
+        return false;
+    }
+
+    struct Song {
+        std::string title;
+        std::string subtitle;
+        const Layout *layout;
+    };
+
+    // Layout is independent for every song, only
+    // putting it onto pages has to happen in order
+    std::vector<Song> laid_out(songs.size());
+    parallel_for(songs.size(), jobs, [&](size_t i) {
+        laid_out[i] = { songs[i]->title(), songs[i]->subtitle(), &songs[i]->layout() };
+    });
+
+    FontUsage usage;
+    usage.header_bold.add("Contents");
+    usage.header.add("0123456789");
+    for (const auto &song : laid_out) {
+        usage.add_song(song.title, song.subtitle, *song.layout);
+        usage.header.add(song.title); // Table of contents
+    }
+
+    try {
+        PdfDocument doc(songs.front()->pdf_settings(), { fn }, nullptr, &usage);
+
+        std::vector<PdfDocument::TocEntry> toc;
+        for (const auto &song : laid_out) {
+            int page_number = doc.page_count() + 1;
+            PdfDocument::PageId page = doc.add_song(song.title, song.subtitle, *song.layout);
+
+            doc.add_outline(song.title, page);
+            toc.push_back({ song.title, page, page_number });
+        }
+
+        doc.add_toc(toc.front().page, toc);
+        doc.finish();
+    } catch (...) {
+        return false;
+    }
+
+    return true;
+}
+
+bool print_song_variants_pdf(std::span<const SongVariant> variants, const PdfSettings &settings,
+                             const std::string &fn)
+{
+    if (variants.empty())
+        return false;
+
+    FontUsage usage;
+    for (const auto &v : variants)
+        usage.add_song(v.title, v.subtitle, v.layout);
+
+    try {
+        PdfDocument doc(settings, { fn }, nullptr, &usage);
+
+        for (const auto &v : variants) {
+            PdfDocument::PageId page = doc.add_song(v.title, v.subtitle, v.layout);
+            doc.add_outline(v.label, page);
+        }
+
+        doc.finish();
+    } catch (...) {
+        return false;
+    }
+
+    return true;
+}
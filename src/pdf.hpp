@@ -0,0 +1,125 @@
+#pragma once
+
+#include <memory>
+#include <optional>
+#include <span>
+#include <string>
+#include <string_view>
+#include <vector>
+
+#include "backend.hpp"
+#include "file.hpp"
+#include "subset.hpp"
+#include "trace.hpp"
+
+// Files of the fonts named in PdfSettings
+struct FontFiles {
+    std::string body;
+    std::string header;
+    std::string header_bold;
+
+    static FontFiles resolve(const PdfSettings &settings);
+};
+
+// Characters shown in each font, so that
+// only their glyphs have to be embedded
+struct FontUsage {
+    CodePoints body;
+    CodePoints header;
+    CodePoints header_bold;
+
+    void add_song(const std::string &title, const std::string &subtitle, const Layout &layout);
+};
+
+// Advance widths of a font at one size, in points, asked of the backend
+// once per document: a flat table by code point, for the Basic Multilingual
+// Plane, filled with the characters in use up front and others on demand
+class GlyphAdvances {
+public:
+    GlyphAdvances() = default;
+    GlyphAdvances(PdfBackend &backend, PdfBackend::Font font, float size, const CodePoints *usage);
+
+    float operator[](char32_t c) {
+        if (c < table.size() && table[c] >= 0)
+            return table[c];
+        return look_up(c);
+    }
+    // Of UTF-8 text, or of Latin-1 text with `utf8` false
+    float width(std::string_view text, bool utf8);
+    bool monospace() { return (*this)['i'] == (*this)['M']; }
+private:
+    PdfBackend *backend = nullptr;
+    PdfBackend::Font font = PdfBackend::Font::Body;
+    float scale = 0; // Font units to points
+    std::vector<float> table; // Negative where not looked up yet
+
+    float look_up(char32_t c);
+};
+
+// A PDF with the fonts loaded once, into which
+// any number of songs can be laid out
+class PdfDocument {
+public:
+    using PageId = PdfBackend::PageId;
+
+    // Throws if the document can't be created.
+    // Fonts are resolved unless `fonts` is given.
+    // With `usage`, UTF-8 documents only embed the glyphs it lists,
+    // and the native writer can be used, which needs to know them.
+    PdfDocument(const PdfSettings &settings, const PdfTarget &target,
+                const FontFiles *fonts = nullptr, const FontUsage *usage = nullptr);
+
+    PdfDocument(const PdfDocument &) = delete;
+    PdfDocument &operator=(const PdfDocument &) = delete;
+
+    // Lays out a song starting on a new page,
+    // returns that page
+    PageId add_song(const std::string &title, const std::string &subtitle, const Layout &layout);
+
+    // Table of contents in front of `first_page`,
+    // linking to the pages of the songs
+    struct TocEntry {
+        std::string title;
+        PageId page;
+        int page_number; // Not counting the table of contents
+    };
+    void add_toc(PageId first_page, const std::vector<TocEntry> &entries);
+
+    void add_outline(const std::string &title, PageId page);
+
+    int page_count() const { return pages; }
+
+    // Writes the rest of the document to the target
+    void finish();
+private:
+    std::unique_ptr<PdfBackend> backend;
+    PdfSettings settings;
+
+    GlyphAdvances body_advances;
+    // Chords are placed by measuring the lyrics below them
+    bool proportional = false;
+
+    int pages = 0;
+    std::optional<trace::Span> page_span;
+    float page_height = 0;
+    float page_width = 0;
+
+    PageId new_page();
+    // Shows lines[i] on the next line, or places it above the next if
+    // it's chords in a proportional font
+    void show_line(const Layout &layout, std::span<const LayoutLine> lines, size_t i,
+                   float leading, std::string &buf);
+    // Shows a line of chords, each above the x at which its column
+    // begins in `lyrics`, and moves back to the start of the line
+    void show_chords(std::string_view chords, std::string_view lyrics, float leading,
+                     std::string &buf);
+};
+
+// Lays out the songs in parallel and writes them into one PDF
+// with a table of contents; fonts and sizes are taken from the first song
+bool print_songbook_pdf(std::span<FileFormatter *const> songs, const std::string &fn, unsigned jobs);
+
+// Writes each variant of a song starting on a new page,
+// with an outline entry per variant
+bool print_song_variants_pdf(std::span<const SongVariant> variants, const PdfSettings &settings,
+                             const std::string &fn);
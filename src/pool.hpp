@@ -0,0 +1,30 @@
+#pragma once
+
+#include <algorithm>
+#include <atomic>
+#include <cstddef>
+#include <thread>
+#include <vector>
+
+// Calls f(i) for every i in [0, n), spread over up to `jobs` threads.
+// Indices are handed out one at a time, so uneven work still balances.
+template<typename F>
+void parallel_for(size_t n, unsigned jobs, F &&f)
+{
+    if (jobs <= 1 || n <= 1) {
+        for (size_t i = 0; i < n; i++)
+            f(i);
+        return;
+    }
+
+    std::atomic<size_t> next = 0;
+    std::vector<std::jthread> workers;
+
+    for (size_t t = 0; t < std::min<size_t>(jobs, n); t++) {
+        workers.emplace_back([&]() {
+            for (size_t i; (i = next.fetch_add(1)) < n;)
+                f(i);
+        });
+    }
+    // jthreads join on destruction
+}
@@ -0,0 +1,487 @@
+#include <algorithm>
+#include <cctype>
+#include <cerrno>
+#include <condition_variable>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <deque>
+#include <map>
+#include <mutex>
+#include <optional>
+#include <sstream>
+#include <stop_token>
+#include <string_view>
+#include <thread>
+#include <utility>
+#include <vector>
+
+#include <arpa/inet.h>
+#include <poll.h>
+#include <sys/eventfd.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/time.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+#include <fmt/core.h>
+
+#include "file.hpp"
+#include "pdf.hpp"
+#include "server.hpp"
+#include "trace.hpp"
+
+// Larger requests are refused
+#define SERVER_MAX_REQUEST (64u << 20)
+// Seconds a response may wait for the client to read it
+#define SERVER_SEND_TIMEOUT 30
+
+static bool read_full(int fd, void *buf, size_t n)
+{
+    char *p = (char*)buf;
+    while (n > 0) {
+        ssize_t r = read(fd, p, n);
+        if (r < 0 && errno == EINTR)
+            continue;
+        if (r <= 0)
+            return false;
+        p += r;
+        n -= r;
+    }
+    return true;
+}
+
+static bool write_full(int fd, const void *buf, size_t n)
+{
+    const char *p = (const char*)buf;
+    while (n > 0) {
+        ssize_t r = send(fd, p, n, MSG_NOSIGNAL);
+        if (r < 0 && errno == EINTR)
+            continue;
+        if (r <= 0)
+            return false;
+        p += r;
+        n -= r;
+    }
+    return true;
+}
+
+static bool read_u32(int fd, uint32_t &v)
+{
+    if (!read_full(fd, &v, sizeof(v)))
+        return false;
+    v = ntohl(v);
+    return true;
+}
+
+static bool write_message(int fd, uint32_t status, std::string_view body)
+{
+    uint32_t header[2] = { htonl(status), htonl((uint32_t)body.size()) };
+    return write_full(fd, header, sizeof(header)) && write_full(fd, body.data(), body.size());
+}
+
+static int unix_socket(const std::string &path, sockaddr_un &addr)
+{
+    if (path.size() >= sizeof(addr.sun_path)) {
+        fmt::print(stderr, "{}: socket path too long\n", path);
+        return -1;
+    }
+
+    addr = {};
+    addr.sun_family = AF_UNIX;
+    std::memcpy(addr.sun_path, path.c_str(), path.size() + 1);
+
+    int fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (fd < 0)
+        std::perror("socket");
+    return fd;
+}
+
+// Font files by (body font, title font), shared by all workers
+class FontCache {
+public:
+    const FontFiles &get(const PdfSettings &settings) {
+        std::lock_guard lock(mutex);
+
+        auto key = std::pair(settings.body_font, settings.title_font);
+        auto it = fonts.find(key);
+        if (it == fonts.end())
+            it = fonts.emplace(key, FontFiles::resolve(settings)).first;
+        // std::map never moves its elements
+        return it->second;
+    }
+private:
+    std::mutex mutex;
+    std::map<std::pair<std::string, std::string>, FontFiles> fonts;
+};
+
+// Returns status and response body
+static std::pair<uint32_t, std::string> handle_request(std::string payload,
+        const Options &overrides, FontCache &fonts)
+{
+    trace::Span span("handle request");
+    span.add_bytes(payload.size());
+
+    Options options = overrides;
+    bool pdf = false;
+
+    std::string_view rest = payload;
+    while (true) {
+        size_t nl = rest.find('\n');
+        if (nl == std::string_view::npos)
+            return { 1, "Missing empty line after options" };
+
+        std::string_view line = rest.substr(0, nl);
+        rest.remove_prefix(nl + 1);
+
+        if (line.empty())
+            break;
+
+        size_t sep = line.find(':');
+        if (sep == std::string_view::npos)
+            return { 1, fmt::format("Option \"{}\" has no value", line) };
+
+        std::string_view key = line.substr(0, sep);
+        std::string_view value = line.substr(sep + 1);
+        while (!value.empty() && std::isspace(value.front()))
+            value.remove_prefix(1);
+
+        if (key == "format") {
+            if (value != "pdf" && value != "txt")
+                return { 1, fmt::format("Unknown format \"{}\"", value) };
+            pdf = value == "pdf";
+        } else if (auto id = Options::find(key)) {
+            if (!options.set(*id, value))
+                return { 1, fmt::format("Invalid {} \"{}\"", key, value) };
+        } else {
+            return { 1, fmt::format("Unknown option \"{}\"", key) };
+        }
+    }
+
+    payload.erase(0, rest.data() - payload.data());
+
+    FileFormatter ff;
+    ff.set_options(options);
+    ff.init_buffer(std::move(payload));
+
+    if (!pdf) {
+        std::stringstream ss;
+        ff.print_formatted_txt(ss);
+        return { 0, ss.str() };
+    }
+
+    const FontFiles *files;
+    try {
+        files = &fonts.get(ff.pdf_settings());
+    } catch (...) {
+        return { 1, "Invalid PDF options" };
+    }
+
+    auto res = ff.formatted_pdf(files);
+    if (!res)
+        return { 1, "Failed to generate PDF" };
+    return { 0, std::move(*res) };
+}
+
+namespace {
+
+// Read in full, to be answered on `fd`
+struct Request {
+    int fd;
+    std::string payload;
+};
+
+// Between the thread that reads requests and the workers answering them.
+// A connection is handed back after its response, which wakes the reader.
+class RequestQueue {
+public:
+    RequestQueue() : wake(eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK)) {}
+    ~RequestQueue() {
+        if (wake >= 0)
+            close(wake);
+    }
+
+    // Readable when connections were handed back; -1 if it couldn't be created
+    int wake_fd() const { return wake; }
+
+    void push(Request req) {
+        {
+            std::lock_guard lock(mutex);
+            requests.push_back(std::move(req));
+        }
+        cv.notify_one();
+    }
+
+    // Waits for a request; empty once `stop` is requested
+    std::optional<Request> pop(std::stop_token stop) {
+        std::unique_lock lock(mutex);
+        if (!cv.wait(lock, stop, [this] { return !requests.empty(); }))
+            return std::nullopt;
+        Request req = std::move(requests.front());
+        requests.pop_front();
+        return req;
+    }
+
+    // `ok` is false if the connection has to be closed
+    void hand_back(int fd, bool ok) {
+        {
+            std::lock_guard lock(mutex);
+            handed_back.emplace_back(fd, ok);
+        }
+        uint64_t one = 1;
+        while (write(wake, &one, sizeof(one)) < 0 && errno == EINTR)
+            ;
+    }
+
+    std::vector<std::pair<int, bool>> take_handed_back() {
+        uint64_t n;
+        while (read(wake, &n, sizeof(n)) < 0 && errno == EINTR)
+            ;
+        std::lock_guard lock(mutex);
+        return std::exchange(handed_back, {});
+    }
+private:
+    int wake;
+    std::mutex mutex;
+    std::condition_variable_any cv;
+    std::deque<Request> requests;
+    std::vector<std::pair<int, bool>> handed_back;
+};
+
+struct Connection {
+    std::string in; // Received, not handed to a worker yet
+    bool busy = false; // A worker is answering it, so it isn't read meanwhile
+};
+
+}
+
+// Queues the next request of `conn` once it's complete; false if the
+// connection has to be closed
+static bool queue_request(int fd, Connection &conn, RequestQueue &queue)
+{
+    uint32_t len;
+    if (conn.busy || conn.in.size() < sizeof(len))
+        return true;
+
+    std::memcpy(&len, conn.in.data(), sizeof(len));
+    len = ntohl(len);
+    if (len > SERVER_MAX_REQUEST) {
+        write_message(fd, 1, "Request too large");
+        return false;
+    }
+    if (conn.in.size() - sizeof(len) < len)
+        return true;
+
+    queue.push({ fd, conn.in.substr(sizeof(len), len) });
+    conn.in.erase(0, sizeof(len) + len);
+    conn.busy = true;
+    return true;
+}
+
+int serve(const std::string &sock_path, const Options &overrides,
+          unsigned workers)
+{
+    sockaddr_un addr;
+    int listen_fd = unix_socket(sock_path, addr);
+    if (listen_fd < 0)
+        return 1;
+
+    // Left behind by a previous server, unless that one still accepts
+    // connections; only a refused connect means nobody is listening
+    if (struct stat st; stat(sock_path.c_str(), &st) == 0 && S_ISSOCK(st.st_mode)) {
+        int probe = unix_socket(sock_path, addr);
+        if (probe < 0) {
+            close(listen_fd);
+            return 1;
+        }
+        int res = connect(probe, (sockaddr*)&addr, sizeof(addr));
+        int err = errno;
+        close(probe);
+
+        if (res == 0) {
+            fmt::print(stderr, "{}: already serving\n", sock_path);
+            close(listen_fd);
+            return 1;
+        }
+        if (err == ECONNREFUSED)
+            unlink(sock_path.c_str());
+    }
+
+    if (bind(listen_fd, (sockaddr*)&addr, sizeof(addr)) < 0 || listen(listen_fd, 64) < 0) {
+        std::perror(sock_path.c_str());
+        close(listen_fd);
+        return 1;
+    }
+
+    FontCache fonts;
+
+    // Resolve the default fonts and load them once
+    // before the first request has to wait for it
+    {
+        FileFormatter ff;
+        ff.set_options(overrides);
+        ff.init_buffer("title: Warm-up\n[Warm-up]\n");
+        try {
+            ff.formatted_pdf(&fonts.get(ff.pdf_settings()));
+        } catch (...) {
+            fmt::print(stderr, "Warning: Invalid PDF options\n");
+        }
+    }
+
+    RequestQueue queue;
+    if (queue.wake_fd() < 0) {
+        std::perror("eventfd");
+        close(listen_fd);
+        return 1;
+    }
+
+    fmt::print(stderr, "Listening on {} with {} workers\n", sock_path, workers);
+
+    // Workers only see whole requests, so idle clients don't hold them up
+    std::vector<std::jthread> threads;
+    for (unsigned i = 0; i < std::max(workers, 1u); i++) {
+        threads.emplace_back([&](std::stop_token stop) {
+            while (auto req = queue.pop(stop)) {
+                auto [status, body] = handle_request(std::move(req->payload), overrides, fonts);
+                queue.hand_back(req->fd, write_message(req->fd, status, body));
+            }
+        });
+    }
+
+    // Connections by socket, read here until a request is complete
+    std::map<int, Connection> conns;
+    std::vector<pollfd> fds;
+    char buf[1 << 16];
+
+    while (true) {
+        fds.clear();
+        fds.push_back({ listen_fd, POLLIN, 0 });
+        fds.push_back({ queue.wake_fd(), POLLIN, 0 });
+        for (const auto &[fd, conn] : conns) {
+            if (!conn.busy)
+                fds.push_back({ fd, POLLIN, 0 });
+        }
+
+        if (poll(fds.data(), fds.size(), -1) < 0) {
+            if (errno == EINTR)
+                continue;
+            std::perror("poll");
+            break;
+        }
+
+        if (fds[1].revents & POLLIN) {
+            for (auto [fd, ok] : queue.take_handed_back()) {
+                Connection &conn = conns[fd];
+                conn.busy = false;
+                // It may have sent the next request already
+                if (!ok || !queue_request(fd, conn, queue)) {
+                    close(fd);
+                    conns.erase(fd);
+                }
+            }
+        }
+
+        for (size_t i = 2; i < fds.size(); i++) {
+            if (!fds[i].revents)
+                continue;
+
+            int fd = fds[i].fd;
+            ssize_t n = recv(fd, buf, sizeof(buf), MSG_DONTWAIT);
+            if (n < 0 && (errno == EINTR || errno == EAGAIN))
+                continue;
+
+            Connection &conn = conns[fd];
+            if (n > 0)
+                conn.in.append(buf, n);
+            if (n <= 0 || !queue_request(fd, conn, queue)) {
+                close(fd);
+                conns.erase(fd);
+            }
+        }
+
+        if (fds[0].revents & POLLIN) {
+            int fd = accept4(listen_fd, nullptr, nullptr, SOCK_CLOEXEC);
+            if (fd < 0 && errno != EINTR && errno != ECONNABORTED) {
+                std::perror("accept");
+                break;
+            }
+            if (fd >= 0) {
+                // A client that stops reading its response only holds a worker this long
+                timeval timeout = { SERVER_SEND_TIMEOUT, 0 };
+                setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &timeout, sizeof(timeout));
+                conns.emplace(fd, Connection{});
+            }
+        }
+    }
+
+    threads.clear(); // Stops and joins the workers
+    for (const auto &[fd, conn] : conns)
+        close(fd);
+    close(listen_fd);
+    return 1;
+}
+
+int serve_request(const std::string &sock_path, const std::string &fn,
+                  const Options &overrides,
+                  bool pdf, const std::string &pdf_fn)
+{
+    MappedFile file;
+    if (!file.open(fn.c_str())) {
+        std::perror(fn.c_str());
+        return 1;
+    }
+
+    std::string payload = fmt::format("format: {}\n", pdf ? "pdf" : "txt");
+    overrides.for_each([&payload](std::string_view key, const std::string &value) {
+        payload += fmt::format("{}: {}\n", key, value);
+    });
+    payload += '\n';
+    payload += file.view();
+
+    sockaddr_un addr;
+    int fd = unix_socket(sock_path, addr);
+    if (fd < 0)
+        return 1;
+
+    if (connect(fd, (sockaddr*)&addr, sizeof(addr)) < 0) {
+        std::perror(sock_path.c_str());
+        close(fd);
+        return 1;
+    }
+
+    uint32_t status, len;
+    std::string body;
+    uint32_t payload_len = htonl((uint32_t)payload.size());
+    bool ok = write_full(fd, &payload_len, sizeof(payload_len))
+        && write_full(fd, payload.data(), payload.size())
+        && read_u32(fd, status) && read_u32(fd, len);
+    if (ok) {
+        body.resize(len);
+        ok = read_full(fd, body.data(), len);
+    }
+    close(fd);
+
+    if (!ok) {
+        fmt::print(stderr, "{}: connection to server failed\n", sock_path);
+        return 1;
+    }
+    if (status != 0) {
+        fmt::print(stderr, "Server: {}\n", body);
+        return 1;
+    }
+
+    if (!pdf) {
+        fmt::print("{}", body);
+        return 0;
+    }
+
+    std::FILE *f = pdf_fn == "-" ? stdout : std::fopen(pdf_fn.c_str(), "wb");
+    if (!f || std::fwrite(body.data(), 1, body.size(), f) != body.size()) {
+        std::perror(pdf_fn.c_str());
+        if (f && f != stdout)
+            std::fclose(f);
+        return 1;
+    }
+    return (f == stdout ? std::fflush(f) : std::fclose(f)) == 0 ? 0 : 1;
+}
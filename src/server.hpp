@@ -0,0 +1,25 @@
+#pragma once
+
+#include <string>
+
+#include "options.hpp"
+
+// Protocol, on a Unix stream socket, any number of requests per connection:
+//
+//   request:  u32 length (big endian), then `length` bytes:
+//             "key: value" lines, an empty line, the song text.
+//             The keys are those of the song header; "format: pdf"
+//             asks for a PDF instead of text.
+//   response: u32 status (0 = ok), u32 length, then `length` bytes:
+//             the text or PDF file, or an error message.
+
+// Serves requests on `sock_path` with `workers` threads, until killed.
+// `overrides` apply to every request, unless it sets the key itself.
+int serve(const std::string &sock_path, const Options &overrides,
+          unsigned workers);
+
+// Sends `fn` to the server at `sock_path`; text is written to stdout,
+// a PDF to `pdf_fn` ("-" for stdout)
+int serve_request(const std::string &sock_path, const std::string &fn,
+                  const Options &overrides,
+                  bool pdf, const std::string &pdf_fn);
@@ -0,0 +1,600 @@
+#include <algorithm>
+#include <cerrno>
+#include <cstdint>
+#include <cstdlib>
+#include <map>
+#include <string>
+#include <string_view>
+#include <utility>
+#include <vector>
+
+#include <unistd.h>
+
+#include <fmt/core.h>
+
+#include "file.hpp"
+#include "subset.hpp"
+#include "trace.hpp"
+
+// https://learn.microsoft.com/en-us/typography/opentype/spec/
+
+void CodePoints::add(std::string_view utf8)
+{
+    for (size_t i = 0; i < utf8.size();) {
+        unsigned char c = utf8[i];
+        if (c < 0x80) {
+            ascii.set(c);
+            i++;
+            continue;
+        }
+
+        size_t len = c >= 0xF8 ? 0 : c >= 0xF0 ? 4 : c >= 0xE0 ? 3 : c >= 0xC0 ? 2 : 0;
+        if (len == 0 || i + len > utf8.size()) {
+            i++;
+            continue;
+        }
+
+        char32_t cp = c & (0x7F >> len);
+        size_t k = 1;
+        for (; k < len && (utf8[i + k] & 0xC0) == 0x80; k++)
+            cp = cp << 6 | (utf8[i + k] & 0x3F);
+        if (k < len) {
+            i++;
+            continue;
+        }
+
+        other.push_back(cp);
+        i += len;
+        compact();
+    }
+}
+
+void CodePoints::add(const CodePoints &other)
+{
+    ascii |= other.ascii;
+    this->other.insert(this->other.end(), other.other.begin(), other.other.end());
+    compact();
+}
+
+void CodePoints::compact()
+{
+    // Songs repeat the same few characters. Waiting for the size to double
+    // keeps the cost down when thousands of them are distinct, as in CJK text.
+    if (other.size() < compact_at)
+        return;
+
+    std::sort(other.begin(), other.end());
+    other.erase(std::unique(other.begin(), other.end()), other.end());
+    compact_at = std::max<size_t>(4096, 2 * other.size());
+}
+
+std::vector<char32_t> CodePoints::sorted() const
+{
+    std::vector<char32_t> res;
+    for (char32_t c = 0; c < 128; c++) {
+        if (ascii[c])
+            res.push_back(c);
+    }
+
+    size_t n_ascii = res.size();
+    res.insert(res.end(), other.begin(), other.end());
+    std::sort(res.begin() + n_ascii, res.end());
+    res.erase(std::unique(res.begin() + n_ascii, res.end()), res.end());
+    return res;
+}
+
+namespace {
+
+// Thrown on malformed or unsupported fonts
+struct FontError {};
+
+uint16_t get16(std::string_view d, size_t off)
+{
+    if (off + 2 > d.size())
+        throw FontError();
+    return (uint8_t)d[off] << 8 | (uint8_t)d[off + 1];
+}
+
+uint32_t get32(std::string_view d, size_t off)
+{
+    return (uint32_t)get16(d, off) << 16 | get16(d, off + 2);
+}
+
+void put16(std::string &s, uint16_t v)
+{
+    s.push_back(v >> 8);
+    s.push_back(v & 0xFF);
+}
+
+void put32(std::string &s, uint32_t v)
+{
+    put16(s, v >> 16);
+    put16(s, v & 0xFFFF);
+}
+
+void set16(std::string &s, size_t off, uint16_t v)
+{
+    if (off + 2 > s.size())
+        throw FontError();
+    s[off] = v >> 8;
+    s[off + 1] = v & 0xFF;
+}
+
+void set32(std::string &s, size_t off, uint32_t v)
+{
+    set16(s, off, v >> 16);
+    set16(s, off + 2, v & 0xFFFF);
+}
+
+void pad4(std::string &s)
+{
+    s.append((4 - s.size() % 4) % 4, '\0');
+}
+
+uint32_t checksum(std::string_view d)
+{
+    uint32_t sum = 0;
+    for (size_t i = 0; i < d.size(); i += 4) {
+        uint32_t word = 0;
+        for (size_t k = 0; k < 4; k++)
+            word = word << 8 | (i + k < d.size() ? (uint8_t)d[i + k] : 0);
+        sum += word;
+    }
+    return sum;
+}
+
+// The Unicode subtable of a cmap
+class CharMap {
+public:
+    explicit CharMap(std::string_view cmap) {
+        // Prefer full Unicode over the BMP
+        int best = 0;
+        uint16_t n = get16(cmap, 2);
+        for (uint16_t i = 0; i < n; i++) {
+            uint16_t platform = get16(cmap, 4 + 8 * i);
+            uint16_t encoding = get16(cmap, 4 + 8 * i + 2);
+            uint32_t offset = get32(cmap, 4 + 8 * i + 4);
+            if (offset >= cmap.size())
+                continue;
+
+            std::string_view sub = cmap.substr(offset);
+            uint16_t format = get16(sub, 0);
+
+            int score = 0;
+            bool unicode = platform == 0 || (platform == 3 && (encoding == 1 || encoding == 10));
+            if (unicode && format == 12)
+                score = 2;
+            else if (unicode && format == 4)
+                score = 1;
+
+            if (score > best) {
+                best = score;
+                table = sub;
+                m_format = format;
+            }
+        }
+
+        if (best == 0)
+            throw FontError();
+    }
+
+    // Glyph of `c`, 0 if there is none
+    uint32_t lookup(char32_t c) const {
+        if (m_format == 12) {
+            uint32_t n = get32(table, 12);
+            // Groups are sorted
+            uint32_t lo = 0, hi = n;
+            while (lo < hi) {
+                uint32_t mid = lo + (hi - lo) / 2;
+                size_t group = 16 + 12 * (size_t)mid;
+                if (get32(table, group + 4) < c) {
+                    lo = mid + 1;
+                } else if (get32(table, group) > c) {
+                    hi = mid;
+                } else {
+                    return get32(table, group + 8) + (c - get32(table, group));
+                }
+            }
+            return 0;
+        }
+
+        if (c > 0xFFFF)
+            return 0;
+
+        size_t seg_x2 = get16(table, 6);
+        size_t ends = 14, starts = 16 + seg_x2, deltas = 16 + 2 * seg_x2, ranges = 16 + 3 * seg_x2;
+        for (size_t i = 0; i < seg_x2; i += 2) {
+            if (get16(table, ends + i) < c)
+                continue;
+            if (get16(table, starts + i) > c)
+                return 0;
+
+            uint16_t delta = get16(table, deltas + i);
+            uint16_t range = get16(table, ranges + i);
+            if (range == 0)
+                return (uint16_t)(c + delta);
+
+            uint16_t g = get16(table, ranges + i + range + 2 * (c - get16(table, starts + i)));
+            return g == 0 ? 0 : (uint16_t)(g + delta);
+        }
+        return 0;
+    }
+private:
+    std::string_view table;
+    uint16_t m_format = 0;
+};
+
+// Calls f(offset, glyph) for the component glyph indices of a composite glyph
+template<typename F>
+void for_each_component(std::string_view glyph, F &&f)
+{
+    if (glyph.size() < 10 || (int16_t)get16(glyph, 0) >= 0)
+        return;
+
+    size_t pos = 10;
+    while (true) {
+        uint16_t flags = get16(glyph, pos);
+        f(pos + 2, get16(glyph, pos + 2));
+
+        pos += 4 + (flags & 0x0001 ? 4 : 2); // ARG_1_AND_2_ARE_WORDS
+        if (flags & 0x0008) // WE_HAVE_A_SCALE
+            pos += 2;
+        else if (flags & 0x0040) // WE_HAVE_AN_X_AND_Y_SCALE
+            pos += 4;
+        else if (flags & 0x0080) // WE_HAVE_A_TWO_BY_TWO
+            pos += 8;
+
+        if (!(flags & 0x0020)) // MORE_COMPONENTS
+            break;
+    }
+}
+
+// Format 4 cmap with one segment per run of characters
+// whose glyphs are numbered consecutively as well
+std::string make_cmap(const std::vector<std::pair<char32_t, uint16_t>> &mapping)
+{
+    struct Segment {
+        uint16_t start, end, delta;
+    };
+
+    std::vector<Segment> segs;
+    for (auto [c, g] : mapping) {
+        uint16_t delta = g - c;
+        if (!segs.empty() && segs.back().end + 1 == (int)c && segs.back().delta == delta)
+            segs.back().end = c;
+        else
+            segs.push_back({ (uint16_t)c, (uint16_t)c, delta });
+    }
+    // Required last segment
+    segs.push_back({ 0xFFFF, 0xFFFF, 1 });
+
+    size_t length = 16 + 8 * segs.size();
+    if (length > 0xFFFF)
+        throw FontError();
+
+    uint16_t n = segs.size();
+    uint16_t pow2 = 1, entry_selector = 0;
+    while (pow2 * 2 <= n) {
+        pow2 *= 2;
+        entry_selector++;
+    }
+
+    std::string res;
+    put16(res, 0); // version
+    put16(res, 1); // numTables
+    put16(res, 3); // Windows
+    put16(res, 1); // Unicode BMP
+    put32(res, 12);
+
+    put16(res, 4);
+    put16(res, length);
+    put16(res, 0); // language
+    put16(res, 2 * n);
+    put16(res, 2 * pow2); // searchRange
+    put16(res, entry_selector);
+    put16(res, 2 * n - 2 * pow2); // rangeShift
+    for (const auto &seg : segs)
+        put16(res, seg.end);
+    put16(res, 0); // reservedPad
+    for (const auto &seg : segs)
+        put16(res, seg.start);
+    for (const auto &seg : segs)
+        put16(res, seg.delta);
+    for (size_t i = 0; i < segs.size(); i++)
+        put16(res, 0); // idRangeOffset
+
+    return res;
+}
+
+// Only the names identifying the font, without license texts and such
+std::string make_name(std::string_view name)
+{
+    uint16_t count = get16(name, 2);
+    std::string_view strings = name.substr(std::min<size_t>(get16(name, 4), name.size()));
+
+    std::string records, storage;
+    uint16_t kept = 0;
+    for (size_t i = 0; i < count; i++) {
+        size_t rec = 6 + 12 * i;
+        // Copyright, family, style, ID, full name, version, PostScript name
+        if (get16(name, rec + 6) > 6)
+            continue;
+
+        uint16_t length = get16(name, rec + 8);
+        uint16_t offset = get16(name, rec + 10);
+        if ((size_t)offset + length > strings.size())
+            throw FontError();
+
+        records.append(name.substr(rec, 8));
+        put16(records, length);
+        put16(records, storage.size());
+        storage.append(strings.substr(offset, length));
+        kept++;
+    }
+
+    std::string res;
+    put16(res, 0); // format
+    put16(res, kept);
+    put16(res, 6 + records.size());
+    return res + records + storage;
+}
+
+// PostScript name from the name table, where it's in
+// ASCII; Windows records are UTF-16, Mac ones single bytes
+std::string postscript_name(std::string_view name)
+{
+    uint16_t count = get16(name, 2);
+    std::string_view strings = name.substr(std::min<size_t>(get16(name, 4), name.size()));
+
+    for (size_t i = 0; i < count; i++) {
+        size_t rec = 6 + 12 * i;
+        uint16_t platform = get16(name, rec);
+        if (get16(name, rec + 6) != 6 || (platform != 1 && platform != 3))
+            continue;
+
+        uint16_t length = get16(name, rec + 8);
+        uint16_t offset = get16(name, rec + 10);
+        if ((size_t)offset + length > strings.size())
+            continue;
+
+        std::string res;
+        for (size_t k = platform == 3 ? 1 : 0; k < length; k += platform == 3 ? 2 : 1)
+            res.push_back(strings[offset + k]);
+        return res;
+    }
+    return {};
+}
+
+void build_subset(std::string_view data, const CodePoints &code_points, FontSubset &out_font)
+{
+    // TrueType outlines only
+    uint32_t version = get32(data, 0);
+    if (version != 0x00010000 && version != 0x74727565)
+        throw FontError();
+
+    std::map<std::string, std::string_view> tables;
+    uint16_t num_tables = get16(data, 4);
+    for (size_t i = 0; i < num_tables; i++) {
+        size_t rec = 12 + 16 * i;
+        uint32_t offset = get32(data, rec + 8);
+        uint32_t length = get32(data, rec + 12);
+        if (offset > data.size() || length > data.size() - offset)
+            throw FontError();
+        tables[std::string(data.substr(rec, 4))] = data.substr(offset, length);
+    }
+
+    auto table = [&tables](const char *tag) {
+        auto it = tables.find(tag);
+        if (it == tables.end())
+            throw FontError();
+        return it->second;
+    };
+
+    std::string_view head = table("head"), hhea = table("hhea"), maxp = table("maxp");
+    std::string_view hmtx = table("hmtx"), loca = table("loca"), glyf = table("glyf");
+
+    uint16_t num_glyphs = get16(maxp, 4);
+    uint16_t num_hmetrics = get16(hhea, 34);
+    bool long_loca = get16(head, 50) != 0;
+    if (num_hmetrics == 0)
+        throw FontError();
+
+    auto glyph = [&](uint16_t g) {
+        size_t beg = long_loca ? get32(loca, 4 * g) : 2 * get16(loca, 2 * g);
+        size_t end = long_loca ? get32(loca, 4 * g + 4) : 2 * get16(loca, 2 * g + 2);
+        if (beg > end || end > glyf.size())
+            throw FontError();
+        return glyf.substr(beg, end - beg);
+    };
+
+    // New glyph numbers, in order of the characters that use them
+    std::vector<int32_t> new_gid(num_glyphs, -1);
+    std::vector<uint16_t> old_gid;
+    auto keep = [&](uint16_t g) -> uint16_t {
+        if (g >= num_glyphs)
+            throw FontError();
+        if (new_gid[g] < 0) {
+            new_gid[g] = old_gid.size();
+            old_gid.push_back(g);
+        }
+        return new_gid[g];
+    };
+
+    keep(0); // .notdef
+
+    CharMap cmap(table("cmap"));
+    std::vector<std::pair<char32_t, uint16_t>> &mapping = out_font.glyphs;
+    for (char32_t c : code_points.sorted()) {
+        // Only the BMP fits into a format 4 cmap,
+        // which is all that PDF readers need
+        if (c >= 0xFFFF)
+            continue;
+        uint32_t g = cmap.lookup(c);
+        if (g == 0 || g >= num_glyphs)
+            continue;
+        mapping.emplace_back(c, keep(g));
+    }
+
+    // Glyphs that composite glyphs are made of
+    for (size_t i = 0; i < old_gid.size(); i++)
+        for_each_component(glyph(old_gid[i]), [&](size_t, uint16_t g) { keep(g); });
+
+    uint16_t n = old_gid.size();
+
+    std::string new_glyf, new_loca, new_hmtx;
+    for (uint16_t g : old_gid) {
+        put32(new_loca, new_glyf.size());
+
+        size_t beg = new_glyf.size();
+        new_glyf.append(glyph(g));
+        for_each_component(glyph(g), [&](size_t pos, uint16_t c) {
+            set16(new_glyf, beg + pos, new_gid[c]);
+        });
+        pad4(new_glyf);
+
+        // Glyphs after the last full metric share its advance
+        put16(new_hmtx, get16(hmtx, 4 * std::min<size_t>(g, num_hmetrics - 1)));
+        put16(new_hmtx, g < num_hmetrics ? get16(hmtx, 4 * g + 2)
+                                         : get16(hmtx, 4 * num_hmetrics + 2 * (g - num_hmetrics)));
+        out_font.advances.push_back(get16(hmtx, 4 * std::min<size_t>(g, num_hmetrics - 1)));
+    }
+    put32(new_loca, new_glyf.size());
+
+    std::map<std::string, std::string> out;
+
+    out["head"] = head;
+    set32(out["head"], 8, 0); // checkSumAdjustment, set below
+    set16(out["head"], 50, 1); // Long loca
+
+    out["maxp"] = maxp;
+    set16(out["maxp"], 4, n);
+
+    out["hhea"] = hhea;
+    set16(out["hhea"], 34, n);
+
+    out["hmtx"] = std::move(new_hmtx);
+    out["loca"] = std::move(new_loca);
+    out["glyf"] = std::move(new_glyf);
+    out["cmap"] = make_cmap(mapping);
+
+    // Version 3 has no glyph names
+    if (auto it = tables.find("post"); it != tables.end() && it->second.size() >= 32) {
+        out["post"] = it->second.substr(0, 32);
+        set32(out["post"], 0, 0x00030000);
+    }
+
+    if (auto it = tables.find("name"); it != tables.end()) {
+        out["name"] = make_name(it->second);
+        out_font.name = postscript_name(it->second);
+    }
+
+    out_font.units_per_em = get16(head, 18);
+    out_font.x_min = get16(head, 36);
+    out_font.y_min = get16(head, 38);
+    out_font.x_max = get16(head, 40);
+    out_font.y_max = get16(head, 42);
+    out_font.ascent = get16(hhea, 4);
+    out_font.descent = get16(hhea, 6);
+    out_font.cap_height = out_font.ascent;
+    // Version 2 added the cap height
+    if (auto it = tables.find("OS/2"); it != tables.end() && it->second.size() >= 90
+        && get16(it->second, 0) >= 2)
+        out_font.cap_height = get16(it->second, 88);
+    out_font.italic_angle = 0;
+    out_font.fixed_pitch = false;
+    if (auto it = tables.find("post"); it != tables.end() && it->second.size() >= 16) {
+        out_font.italic_angle = (int16_t)get16(it->second, 4);
+        out_font.fixed_pitch = get32(it->second, 12) != 0;
+    }
+    if (out_font.units_per_em == 0)
+        throw FontError();
+
+    // Independent of glyph numbers
+    for (const char *tag : { "OS/2", "cvt ", "fpgm", "prep", "gasp" }) {
+        if (auto it = tables.find(tag); it != tables.end())
+            out[tag] = it->second;
+    }
+
+    uint16_t count = out.size();
+    uint16_t search_range = 1, entry_selector = 0;
+    while (search_range * 2 <= count) {
+        search_range *= 2;
+        entry_selector++;
+    }
+
+    std::string res;
+    put32(res, 0x00010000);
+    put16(res, count);
+    put16(res, search_range * 16);
+    put16(res, entry_selector);
+    put16(res, count * 16 - search_range * 16);
+
+    size_t offset = 12 + 16 * count;
+    size_t head_offset = 0;
+    for (const auto &[tag, d] : out) {
+        if (tag == "head")
+            head_offset = offset;
+
+        res += tag;
+        put32(res, checksum(d));
+        put32(res, offset);
+        put32(res, d.size());
+        offset += (d.size() + 3) / 4 * 4;
+    }
+    for (const auto &[tag, d] : out) {
+        res += d;
+        pad4(res);
+    }
+
+    set32(res, head_offset + 8, 0xB1B0AFBA - checksum(res));
+    out_font.data = std::move(res);
+}
+
+}
+
+std::optional<FontSubset> make_font_subset(const std::string &fn, const CodePoints &code_points)
+{
+    trace::Span span("subset font", fn);
+
+    MappedFile file;
+    if (!file.open(fn.c_str()))
+        return std::nullopt;
+
+    FontSubset res;
+    try {
+        build_subset(file.view(), code_points, res);
+    } catch (const FontError &) {
+        return std::nullopt;
+    }
+    span.add_bytes(res.data.size());
+    return res;
+}
+
+std::optional<std::string> subset_font(const std::string &fn, const CodePoints &code_points)
+{
+    auto subset = make_font_subset(fn, code_points);
+    if (!subset)
+        return std::nullopt;
+    const std::string &font = subset->data;
+
+    const char *tmpdir = std::getenv("TMPDIR");
+    std::string path = fmt::format("{}/acchording-XXXXXX.ttf", tmpdir && *tmpdir ? tmpdir : "/tmp");
+
+    int fd = mkstemps(path.data(), 4);
+    if (fd < 0)
+        return std::nullopt;
+
+    bool ok = true;
+    for (size_t pos = 0; ok && pos < font.size();) {
+        ssize_t w = write(fd, font.data() + pos, font.size() - pos);
+        ok = w > 0 || (w < 0 && errno == EINTR);
+        pos += std::max<ssize_t>(w, 0);
+    }
+    ok = close(fd) == 0 && ok;
+
+    if (!ok) {
+        unlink(path.c_str());
+        return std::nullopt;
+    }
+    return path;
+}
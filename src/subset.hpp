@@ -0,0 +1,49 @@
+#pragma once
+
+#include <bitset>
+#include <optional>
+#include <string>
+#include <string_view>
+#include <utility>
+#include <vector>
+
+// Unicode code points shown in one font
+class CodePoints {
+public:
+    // Invalid UTF-8 is skipped
+    void add(std::string_view utf8);
+    void add(const CodePoints &other);
+
+    // Sorted, without duplicates
+    std::vector<char32_t> sorted() const;
+private:
+    std::bitset<128> ascii;
+    std::vector<char32_t> other;
+    size_t compact_at = 4096; // Duplicates in `other` are removed at this size
+
+    void compact();
+};
+
+// A TrueType font cut down to some characters, with what
+// a PDF needs to know about it to embed the font itself
+struct FontSubset {
+    std::string data; // The font file
+    std::string name; // PostScript name, empty if there is none
+    // Code points in order, with their glyphs
+    std::vector<std::pair<char32_t, uint16_t>> glyphs;
+    std::vector<uint16_t> advances; // By glyph, in font units
+    uint16_t units_per_em;
+    int16_t x_min, y_min, x_max, y_max;
+    int16_t ascent, descent, cap_height;
+    int16_t italic_angle; // Degrees, rounded down
+    bool fixed_pitch;
+};
+
+// Returns nothing if the font can't be subset, e.g. because it has CFF outlines
+std::optional<FontSubset> make_font_subset(const std::string &fn, const CodePoints &code_points);
+
+// Writes a copy of the TrueType font `fn` to a temporary file, with only
+// the glyphs needed for `code_points` and without tables a PDF doesn't use.
+// Returns the file's path; the caller deletes it. Returns nothing if the
+// font can't be subset, e.g. because it has CFF outlines.
+std::optional<std::string> subset_font(const std::string &fn, const CodePoints &code_points);
@@ -0,0 +1,145 @@
+#include <atomic>
+#include <chrono>
+#include <cstdio>
+#include <map>
+#include <mutex>
+#include <vector>
+
+#include <unistd.h>
+
+#include <fmt/core.h>
+
+#include "trace.hpp"
+
+namespace trace {
+
+struct Event {
+    const char *name;
+    std::string detail;
+    uint64_t start_ns;
+    uint64_t dur_ns;
+    size_t bytes;
+    int tid;
+};
+
+static std::atomic<bool> is_enabled = false;
+
+static std::mutex events_mutex;
+static std::vector<Event> events;
+
+static uint64_t now_ns()
+{
+    using namespace std::chrono;
+    return duration_cast<nanoseconds>(steady_clock::now().time_since_epoch()).count();
+}
+
+// Small, stable thread numbers read better than pthread ids
+static int thread_id()
+{
+    static std::atomic<int> next_tid = 1;
+    thread_local int tid = next_tid++;
+    return tid;
+}
+
+void enable()
+{
+    is_enabled = true;
+}
+
+bool enabled()
+{
+    return is_enabled.load(std::memory_order_relaxed);
+}
+
+Span::Span(const char *name, std::string_view detail)
+    : name(name)
+{
+    if (!enabled())
+        return;
+
+    this->detail = detail;
+    start_ns = now_ns();
+}
+
+Span::~Span()
+{
+    if (!enabled() || start_ns == 0)
+        return;
+
+    uint64_t end_ns = now_ns();
+
+    std::lock_guard lock(events_mutex);
+    events.push_back({ name, std::move(detail), start_ns, end_ns - start_ns, bytes, thread_id() });
+}
+
+std::string json_escape(std::string_view s)
+{
+    std::string res;
+    for (char c : s) {
+        if (c == '"' || c == '\\')
+            res += fmt::format("\\{}", c);
+        else if ((unsigned char)c < 0x20)
+            res += fmt::format("\\u{:04x}", c);
+        else
+            res += c;
+    }
+    return res;
+}
+
+bool write_chrome_trace(const std::string &fn)
+{
+    std::FILE *f = std::fopen(fn.c_str(), "w");
+    if (!f) {
+        std::perror(fn.c_str());
+        return false;
+    }
+
+    std::lock_guard lock(events_mutex);
+
+    uint64_t base = events.empty() ? 0 : events.front().start_ns;
+    for (const auto &e : events)
+        base = std::min(base, e.start_ns);
+
+    int pid = getpid();
+
+    fmt::print(f, "{{\"displayTimeUnit\": \"ms\", \"traceEvents\": [\n");
+    for (size_t i = 0; i < events.size(); i++) {
+        const Event &e = events[i];
+        fmt::print(f, "{{\"name\": \"{}\", \"cat\": \"acchording\", \"ph\": \"X\", \"ts\": {:.3f}, \"dur\": {:.3f}, "
+                      "\"pid\": {}, \"tid\": {}, \"args\": {{\"detail\": \"{}\", \"bytes\": {}}}}}{}\n",
+                   e.name, (e.start_ns - base) / 1e3, e.dur_ns / 1e3,
+                   pid, e.tid, json_escape(e.detail), e.bytes,
+                   i + 1 < events.size() ? "," : "");
+    }
+    fmt::print(f, "]}}\n");
+
+    bool ok = !std::ferror(f);
+    std::fclose(f);
+    return ok;
+}
+
+void print_stats()
+{
+    struct Total {
+        size_t count = 0;
+        uint64_t ns = 0;
+        size_t bytes = 0;
+    };
+
+    std::map<std::string_view, Total> totals;
+    {
+        std::lock_guard lock(events_mutex);
+        for (const auto &e : events) {
+            Total &t = totals[e.name];
+            t.count++;
+            t.ns += e.dur_ns;
+            t.bytes += e.bytes;
+        }
+    }
+
+    fmt::print(stderr, "{:<20} {:>8} {:>12} {:>12}\n", "phase", "count", "total ms", "bytes");
+    for (const auto &[name, t] : totals)
+        fmt::print(stderr, "{:<20} {:>8} {:>12.3f} {:>12}\n", name, t.count, t.ns / 1e6, t.bytes);
+}
+
+} /* namespace trace */
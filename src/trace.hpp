@@ -0,0 +1,43 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <string>
+#include <string_view>
+
+// Timing of the phases of a run, for --trace and --stats.
+// Spans cost next to nothing unless tracing was enabled.
+namespace trace {
+
+void enable();
+bool enabled();
+
+// Measures from construction to destruction
+class Span {
+public:
+    // `name` has to be a string literal
+    Span(const char *name, std::string_view detail = {});
+    ~Span();
+
+    Span(const Span &) = delete;
+    Span &operator=(const Span &) = delete;
+
+    // Amount of data processed in this span
+    void add_bytes(size_t n) { bytes += n; }
+private:
+    const char *name;
+    std::string detail;
+    uint64_t start_ns = 0;
+    size_t bytes = 0;
+};
+
+// Chrome trace-event format, as read by Perfetto or chrome://tracing
+bool write_chrome_trace(const std::string &fn);
+
+// Totals per phase on stderr
+void print_stats();
+
+// `s` for inside a JSON string, with quotes, backslashes and control characters escaped
+std::string json_escape(std::string_view s);
+
+} /* namespace trace */
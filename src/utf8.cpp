@@ -0,0 +1,399 @@
+#include <algorithm>
+#include <array>
+#include <cstring>
+#include <initializer_list>
+#include <utility>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define UTF8_X86 1
+#endif
+
+#include "utf8.hpp"
+
+namespace utf8 {
+
+// Eight bytes at a time; the tail and the non-x86 fallback
+static size_t ascii_prefix_scalar(const char *p, size_t n)
+{
+    size_t i = 0;
+    for (; i + 8 <= n; i += 8) {
+        uint64_t word;
+        std::memcpy(&word, p + i, 8);
+        if (word & 0x8080808080808080ull)
+            break;
+    }
+    while (i < n && (unsigned char)p[i] < 0x80)
+        i++;
+    return i;
+}
+
+#ifdef UTF8_X86
+
+// SSE2 is part of x86-64, so this needs no check
+static size_t ascii_prefix_sse2(const char *p, size_t n)
+{
+    size_t i = 0;
+    for (; i + 16 <= n; i += 16) {
+        int mask = _mm_movemask_epi8(_mm_loadu_si128((const __m128i*)(p + i)));
+        if (mask)
+            return i + __builtin_ctz(mask);
+    }
+    return i + ascii_prefix_scalar(p + i, n - i);
+}
+
+__attribute__((target("avx2")))
+static size_t ascii_prefix_avx2(const char *p, size_t n)
+{
+    size_t i = 0;
+    for (; i + 32 <= n; i += 32) {
+        int mask = _mm256_movemask_epi8(_mm256_loadu_si256((const __m256i*)(p + i)));
+        if (mask)
+            return i + __builtin_ctz(mask);
+    }
+    return i + ascii_prefix_sse2(p + i, n - i);
+}
+
+#endif
+
+static size_t ascii_prefix(std::string_view text)
+{
+#ifdef UTF8_X86
+    static const bool avx2 = __builtin_cpu_supports("avx2");
+    if (avx2)
+        return ascii_prefix_avx2(text.data(), text.size());
+    return ascii_prefix_sse2(text.data(), text.size());
+#else
+    return ascii_prefix_scalar(text.data(), text.size());
+#endif
+}
+
+namespace {
+
+// Without SIMD, validation runs a state machine over each byte's class
+enum Class : uint8_t {
+    ASCII,
+    CONT_80, // Continuation bytes 80-8F
+    CONT_90, // 90-9F
+    CONT_A0, // A0-BF
+    LEAD_2, // C2-DF
+    LEAD_E0,
+    LEAD_3, // E1-EC, EE-EF
+    LEAD_ED,
+    LEAD_F0,
+    LEAD_4, // F1-F3
+    LEAD_F4,
+    INVALID, // C0, C1, F5-FF
+};
+constexpr size_t CLASSES = INVALID + 1;
+
+// Between characters, expecting 1-3 more continuation bytes, or the
+// restricted second byte after E0, ED, F0 or F4: no overlong forms,
+// no surrogates, nothing above U+10FFFF (RFC 3629)
+enum State : uint8_t { ACCEPT, NEED_1, NEED_2, NEED_3, AFTER_E0, AFTER_ED, AFTER_F0, AFTER_F4, REJECT };
+constexpr size_t STATES = REJECT + 1;
+
+constexpr auto classes = [] {
+    std::array<uint8_t, 256> res;
+    for (int c = 0; c < 256; c++) {
+        res[c] = c < 0x80 ? ASCII : c < 0x90 ? CONT_80 : c < 0xA0 ? CONT_90 : c < 0xC0 ? CONT_A0
+            : c < 0xC2 ? INVALID : c < 0xE0 ? LEAD_2 : c == 0xE0 ? LEAD_E0 : c == 0xED ? LEAD_ED
+            : c < 0xF0 ? LEAD_3 : c == 0xF0 ? LEAD_F0 : c < 0xF4 ? LEAD_4 : c == 0xF4 ? LEAD_F4
+            : INVALID;
+    }
+    return res;
+}();
+
+constexpr auto transitions = [] {
+    std::array<uint8_t, STATES * CLASSES> res;
+    res.fill(REJECT);
+    auto set = [&res](State from, std::initializer_list<Class> cls, State to) {
+        for (Class c : cls)
+            res[from * CLASSES + c] = to;
+    };
+    auto cont = { CONT_80, CONT_90, CONT_A0 };
+    set(ACCEPT, { ASCII }, ACCEPT);
+    set(ACCEPT, { LEAD_2 }, NEED_1);
+    set(ACCEPT, { LEAD_E0 }, AFTER_E0);
+    set(ACCEPT, { LEAD_3 }, NEED_2);
+    set(ACCEPT, { LEAD_ED }, AFTER_ED);
+    set(ACCEPT, { LEAD_F0 }, AFTER_F0);
+    set(ACCEPT, { LEAD_4 }, NEED_3);
+    set(ACCEPT, { LEAD_F4 }, AFTER_F4);
+    set(NEED_1, cont, ACCEPT);
+    set(NEED_2, cont, NEED_1);
+    set(NEED_3, cont, NEED_2);
+    set(AFTER_E0, { CONT_A0 }, NEED_1);
+    set(AFTER_ED, { CONT_80, CONT_90 }, NEED_1);
+    set(AFTER_F0, { CONT_90, CONT_A0 }, NEED_2);
+    set(AFTER_F4, { CONT_80 }, NEED_2);
+    return res;
+}();
+
+}
+
+static bool valid_scalar(const char *p, size_t n)
+{
+    uint8_t state = ACCEPT;
+    for (size_t i = 0; i < n; i++)
+        state = transitions[state * CLASSES + classes[(unsigned char)p[i]]];
+    return state == ACCEPT;
+}
+
+#ifdef UTF8_X86
+
+// Keiser and Lemire, "Validating UTF-8 In Less Than One Instruction Per
+// Byte": each byte and the one before it are looked up by nibble in three
+// tables of error bits, and the pair is invalid if all three share one.
+// Whether the byte has to be the third or fourth of a sequence is checked
+// apart, against the bytes two and three before it.
+namespace {
+
+enum : uint8_t {
+    TOO_SHORT = 1 << 0, // Lead byte not followed by a continuation
+    TOO_LONG = 1 << 1, // Continuation after ASCII
+    OVERLONG_3 = 1 << 2,
+    TOO_LARGE = 1 << 3, // Above U+10FFFF
+    SURROGATE = 1 << 4,
+    OVERLONG_2 = 1 << 5,
+    TOO_LARGE_1000 = 1 << 6,
+    OVERLONG_4 = 1 << 6,
+    TWO_CONTS = 1 << 7, // Fine only as third or fourth byte
+    CARRY = TOO_SHORT | TOO_LONG | TWO_CONTS,
+};
+
+// Indexed by nibble
+alignas(16) constexpr uint8_t byte_1_high[16] = {
+    TOO_LONG, TOO_LONG, TOO_LONG, TOO_LONG, TOO_LONG, TOO_LONG, TOO_LONG, TOO_LONG,
+    TWO_CONTS, TWO_CONTS, TWO_CONTS, TWO_CONTS,
+    TOO_SHORT | OVERLONG_2,
+    TOO_SHORT,
+    TOO_SHORT | OVERLONG_3 | SURROGATE,
+    TOO_SHORT | TOO_LARGE | TOO_LARGE_1000 | OVERLONG_4,
+};
+alignas(16) constexpr uint8_t byte_1_low[16] = {
+    CARRY | OVERLONG_3 | OVERLONG_2 | OVERLONG_4,
+    CARRY | OVERLONG_2,
+    CARRY,
+    CARRY,
+    CARRY | TOO_LARGE,
+    CARRY | TOO_LARGE | TOO_LARGE_1000,
+    CARRY | TOO_LARGE | TOO_LARGE_1000,
+    CARRY | TOO_LARGE | TOO_LARGE_1000,
+    CARRY | TOO_LARGE | TOO_LARGE_1000,
+    CARRY | TOO_LARGE | TOO_LARGE_1000,
+    CARRY | TOO_LARGE | TOO_LARGE_1000,
+    CARRY | TOO_LARGE | TOO_LARGE_1000,
+    CARRY | TOO_LARGE | TOO_LARGE_1000,
+    CARRY | TOO_LARGE | TOO_LARGE_1000 | SURROGATE,
+    CARRY | TOO_LARGE | TOO_LARGE_1000,
+    CARRY | TOO_LARGE | TOO_LARGE_1000,
+};
+alignas(16) constexpr uint8_t byte_2_high[16] = {
+    TOO_SHORT, TOO_SHORT, TOO_SHORT, TOO_SHORT, TOO_SHORT, TOO_SHORT, TOO_SHORT, TOO_SHORT,
+    TOO_LONG | OVERLONG_2 | TWO_CONTS | OVERLONG_3 | TOO_LARGE_1000 | OVERLONG_4,
+    TOO_LONG | OVERLONG_2 | TWO_CONTS | OVERLONG_3 | TOO_LARGE,
+    TOO_LONG | OVERLONG_2 | TWO_CONTS | SURROGATE | TOO_LARGE,
+    TOO_LONG | OVERLONG_2 | TWO_CONTS | SURROGATE | TOO_LARGE,
+    TOO_SHORT, TOO_SHORT, TOO_SHORT, TOO_SHORT,
+};
+// Lead bytes that need more bytes than there are left in a block
+alignas(16) constexpr uint8_t incomplete_max[16] = {
+    0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF,
+    0xF0 - 1, 0xE0 - 1, 0xC0 - 1,
+};
+
+struct Validator {
+    __m128i prev = _mm_setzero_si128();
+    __m128i incomplete = _mm_setzero_si128(); // Lead bytes at the end of prev
+    __m128i error = _mm_setzero_si128();
+};
+
+}
+
+__attribute__((target("ssse3")))
+static inline __m128i lookup(const uint8_t (&table)[16], __m128i nibbles)
+{
+    return _mm_shuffle_epi8(_mm_load_si128((const __m128i*)table), nibbles);
+}
+
+__attribute__((target("ssse3")))
+static inline void validate_block(Validator &v, __m128i in)
+{
+    if (_mm_movemask_epi8(in) == 0) {
+        v.error = _mm_or_si128(v.error, v.incomplete);
+        v.incomplete = _mm_setzero_si128();
+        v.prev = in;
+        return;
+    }
+
+    const __m128i low_nibble = _mm_set1_epi8(0x0F);
+
+    __m128i prev1 = _mm_alignr_epi8(in, v.prev, 15);
+    __m128i prev2 = _mm_alignr_epi8(in, v.prev, 14);
+    __m128i prev3 = _mm_alignr_epi8(in, v.prev, 13);
+
+    __m128i special = _mm_and_si128(
+        _mm_and_si128(lookup(byte_1_high, _mm_and_si128(_mm_srli_epi16(prev1, 4), low_nibble)),
+                      lookup(byte_1_low, _mm_and_si128(prev1, low_nibble))),
+        lookup(byte_2_high, _mm_and_si128(_mm_srli_epi16(in, 4), low_nibble)));
+
+    // High bit set where two bytes back is E0 or more, or three back F0 or more
+    __m128i third = _mm_subs_epu8(prev2, _mm_set1_epi8((char)(0xE0 - 0x80)));
+    __m128i fourth = _mm_subs_epu8(prev3, _mm_set1_epi8((char)(0xF0 - 0x80)));
+    __m128i must_continue = _mm_and_si128(_mm_or_si128(third, fourth), _mm_set1_epi8((char)0x80));
+
+    v.error = _mm_or_si128(v.error, _mm_xor_si128(must_continue, special));
+    v.incomplete = _mm_subs_epu8(in, _mm_load_si128((const __m128i*)incomplete_max));
+    v.prev = in;
+}
+
+__attribute__((target("ssse3")))
+static bool valid_ssse3(const char *p, size_t n)
+{
+    Validator v;
+    size_t i = 0;
+    for (; i + 16 <= n; i += 16)
+        validate_block(v, _mm_loadu_si128((const __m128i*)(p + i)));
+
+    // The tail padded with zeros, then a block of zeros to catch
+    // a sequence cut off at the end
+    alignas(16) char tail[16] = {};
+    std::memcpy(tail, p + i, n - i);
+    validate_block(v, _mm_load_si128((const __m128i*)tail));
+    validate_block(v, _mm_setzero_si128());
+
+    return _mm_movemask_epi8(_mm_cmpeq_epi8(v.error, _mm_setzero_si128())) == 0xFFFF;
+}
+
+#endif
+
+static bool valid(std::string_view text)
+{
+#ifdef UTF8_X86
+    static const bool ssse3 = __builtin_cpu_supports("ssse3");
+    if (ssse3)
+        return valid_ssse3(text.data(), text.size());
+#endif
+    return valid_scalar(text.data(), text.size());
+}
+
+Encoding detect(std::string_view text)
+{
+    size_t ascii = ascii_prefix(text);
+    if (ascii == text.size())
+        return Encoding::Ascii;
+    return valid(text.substr(ascii)) ? Encoding::Utf8 : Encoding::Other;
+}
+
+char32_t decode(std::string_view s, size_t &i)
+{
+    unsigned char c = s[i++];
+    if (c < 0x80)
+        return c;
+
+    int len = c >= 0xF0 ? 4 : c >= 0xE0 ? 3 : 2;
+    char32_t cp = c & (0x7F >> len);
+    for (int k = 1; k < len && i < s.size(); k++)
+        cp = cp << 6 | (s[i++] & 0x3F);
+    return cp;
+}
+
+namespace {
+
+struct Range {
+    char32_t first, last;
+};
+
+// East Asian Wide (W) and Fullwidth (F), merged into runs
+constexpr std::array<Range, 22> wide = {{
+    { 0x1100, 0x115F }, // Hangul Jamo
+    { 0x231A, 0x231B },
+    { 0x2329, 0x232A },
+    { 0x23E9, 0x23EC },
+    { 0x2E80, 0x303E }, // CJK radicals, punctuation
+    { 0x3041, 0x33FF }, // Kana, CJK compatibility
+    { 0x3400, 0x4DBF }, // CJK extension A
+    { 0x4E00, 0x9FFF }, // CJK unified ideographs
+    { 0xA000, 0xA4CF }, // Yi
+    { 0xA960, 0xA97F },
+    { 0xAC00, 0xD7A3 }, // Hangul syllables
+    { 0xF900, 0xFAFF }, // CJK compatibility ideographs
+    { 0xFE10, 0xFE19 },
+    { 0xFE30, 0xFE6F },
+    { 0xFF00, 0xFF60 }, // Fullwidth forms
+    { 0xFFE0, 0xFFE6 },
+    { 0x16FE0, 0x18CFF }, // Tangut
+    { 0x1B000, 0x1B2FF }, // Kana supplement
+    { 0x1F300, 0x1F64F }, // Emoji
+    { 0x1F900, 0x1F9FF },
+    { 0x20000, 0x2FFFD },
+    { 0x30000, 0x3FFFD },
+}};
+
+// Combining marks and zero-width characters
+constexpr std::array<Range, 11> zero = {{
+    { 0x0300, 0x036F },
+    { 0x0483, 0x0489 },
+    { 0x0591, 0x05BD },
+    { 0x0610, 0x061A },
+    { 0x064B, 0x065F },
+    { 0x1AB0, 0x1AFF },
+    { 0x1DC0, 0x1DFF },
+    { 0x200B, 0x200F },
+    { 0x20D0, 0x20FF },
+    { 0xFE00, 0xFE0F },
+    { 0xFE20, 0xFE2F },
+}};
+
+template<size_t N>
+constexpr bool in(const std::array<Range, N> &ranges, char32_t c)
+{
+    auto it = std::upper_bound(ranges.begin(), ranges.end(), c,
+                               [](char32_t c, const Range &r) { return c < r.first; });
+    return it != ranges.begin() && c <= std::prev(it)->last;
+}
+
+// Lead bytes of characters that may not take up one column: the
+// two-byte ones covering a combining mark and all from U+1000 on
+constexpr auto special_lead = [] {
+    std::array<bool, 256> res = {};
+    for (int c = 0xC2; c < 0xE0; c++) {
+        char32_t first = (c & 0x1F) << 6, last = first + 0x3F;
+        for (Range r : zero)
+            res[c] |= r.first <= last && r.last >= first;
+    }
+    for (int c = 0xE1; c < 0xF5; c++)
+        res[c] = true;
+    return res;
+}();
+
+}
+
+int width(char32_t c)
+{
+    if (c < 0x300)
+        return 1;
+    if (in(zero, c))
+        return 0;
+    // Nothing is wide below Hangul Jamo
+    return c >= 0x1100 && in(wide, c) ? 2 : 1;
+}
+
+size_t columns(std::string_view text)
+{
+    size_t cols = 0;
+    for (size_t i = 0; i < text.size(); i++) {
+        unsigned char c = text[i];
+        // One column per character, unless it may be wide or zero-width
+        cols += (c & 0xC0) != 0x80;
+        if (special_lead[c]) {
+            size_t next = i;
+            cols += width(decode(text, next)) - 1;
+            i = next - 1;
+        }
+    }
+    return cols;
+}
+
+}
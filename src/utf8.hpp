@@ -0,0 +1,32 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <string_view>
+
+namespace utf8 {
+
+enum class Encoding : uint8_t {
+    Ascii,
+    Utf8, // Valid, with some non-ASCII characters
+    Other, // Not valid UTF-8, e.g. Latin-1
+};
+
+// Checks a whole text once, 16 bytes at a time with SSSE3 where
+// available; leading ASCII is skipped with SSE2 or AVX2
+Encoding detect(std::string_view text);
+
+// Of text in `a` followed by text in `b`
+constexpr Encoding join(Encoding a, Encoding b) { return a > b ? a : b; }
+
+// Decodes the character at s[i] and moves i past it; `s` has to be valid
+char32_t decode(std::string_view s, size_t &i);
+
+// Columns a character takes up in monospace text: 2 for East Asian wide
+// and fullwidth characters, 0 for combining marks, 1 for anything else
+int width(char32_t c);
+
+// Columns of valid UTF-8 `text`
+size_t columns(std::string_view text);
+
+}
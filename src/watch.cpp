@@ -0,0 +1,141 @@
+#include <cerrno>
+#include <chrono>
+#include <cstdio>
+#include <filesystem>
+#include <optional>
+#include <string_view>
+
+#include <poll.h>
+#include <sys/inotify.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <fmt/core.h>
+
+#include "file.hpp"
+#include "pdf.hpp"
+#include "watch.hpp"
+
+static void write_text(const Layout &text)
+{
+    fflush(stdout);
+
+    if (isatty(STDOUT_FILENO)) {
+        // Clear the terminal
+        fmt::print("\033[H\033[2J");
+    } else if (struct stat st; fstat(STDOUT_FILENO, &st) == 0 && S_ISREG(st.st_mode)) {
+        // Replace the previous render
+        if (ftruncate(STDOUT_FILENO, 0) == 0)
+            lseek(STDOUT_FILENO, 0, SEEK_SET);
+    }
+
+    fflush(stdout);
+    text.write_to(STDOUT_FILENO);
+}
+
+int watch(const std::string &fn, const Options &overrides,
+          bool pdf, const std::string &pdf_fn)
+{
+    std::filesystem::path path(fn);
+    std::string dir = path.has_parent_path() ? path.parent_path().string() : ".";
+    std::string name = path.filename().string();
+
+    int in = inotify_init1(IN_CLOEXEC);
+    if (in < 0) {
+        std::perror("inotify");
+        return 1;
+    }
+
+    // Editors often save by writing a new file and renaming it
+    // over the old one, so watch the directory, not the file
+    if (inotify_add_watch(in, dir.c_str(), IN_CLOSE_WRITE | IN_MOVED_TO | IN_CREATE) < 0) {
+        std::perror(dir.c_str());
+        close(in);
+        return 1;
+    }
+
+    SectionCache cache;
+
+    // Font names and the files they resolved to
+    std::optional<std::pair<std::string, std::string>> font_names;
+    FontFiles fonts;
+
+    auto render = [&]() {
+        auto beg = std::chrono::steady_clock::now();
+
+        FileFormatter ff;
+        ff.set_options(overrides);
+
+        // A mapping would crash the process if the file were
+        // truncated while it is read, as some editors do on save
+        if (!ff.init_copy(fn.c_str()))
+            return;
+
+        ff.set_section_cache(&cache);
+
+        bool ok = true;
+        if (pdf) {
+            try {
+                PdfSettings settings = ff.pdf_settings();
+
+                std::pair names(settings.body_font, settings.title_font);
+                if (font_names != names) {
+                    fonts = FontFiles::resolve(settings);
+                    font_names = names;
+                }
+            } catch (...) {
+                fmt::print(stderr, "{}: invalid PDF options\n", fn);
+                return;
+            }
+
+            ok = ff.print_formatted_pdf(pdf_fn, &fonts);
+        } else {
+            write_text(ff.layout());
+        }
+
+        // Sections that were removed or changed
+        cache.prune();
+
+        auto end = std::chrono::steady_clock::now();
+        if (ok) {
+            fmt::print(stderr, "{}: rendered in {:.1f} ms\n", fn,
+                       std::chrono::duration<double, std::milli>(end - beg).count());
+        } else {
+            fmt::print(stderr, "{}: failed to write PDF\n", fn);
+        }
+    };
+
+    render();
+
+    alignas(inotify_event) char buf[4096];
+    while (true) {
+        ssize_t n = read(in, buf, sizeof(buf));
+        if (n < 0) {
+            if (errno == EINTR)
+                continue;
+            std::perror("inotify");
+            close(in);
+            return 1;
+        }
+
+        bool changed = false;
+        for (char *p = buf; p < buf + n;) {
+            auto *event = (inotify_event*)p;
+            if (event->len > 0 && name == event->name)
+                changed = true;
+            p += sizeof(inotify_event) + event->len;
+        }
+        if (!changed)
+            continue;
+
+        // A save usually produces several events in a row,
+        // render once after they have settled
+        pollfd pfd = { in, POLLIN, 0 };
+        while (poll(&pfd, 1, 10) > 0) {
+            if (read(in, buf, sizeof(buf)) < 0)
+                break;
+        }
+
+        render();
+    }
+}
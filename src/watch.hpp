@@ -0,0 +1,12 @@
+#pragma once
+
+#include <string>
+
+#include "options.hpp"
+
+// Renders `fn` and renders it again whenever it is saved, until killed.
+// PDFs are written to `pdf_fn`; text goes to stdout, which is rewritten
+// from the start if it is a file.
+// Formatted sections and resolved fonts are kept between renders.
+int watch(const std::string &fn, const Options &overrides,
+          bool pdf, const std::string &pdf_fn);